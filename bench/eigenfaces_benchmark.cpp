@@ -0,0 +1,365 @@
+/*
+ * Face recognition based on Eigenfaces for Urbi
+ * Copyright (C) 2012  Lukasz Malek
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * File:   eigenfaces_benchmark.cpp
+ */
+
+/*
+ * Benchmark of the Eigenfaces core
+ *
+ * Builds a synthetic gallery, every label a random face plus noise per
+ * image, and times the PCA solvers, projection, the search variants,
+ * reconstruction, the binary and XML databases and the preprocessing. Every case
+ * reports latency percentiles and throughput, optionally as JSON:
+ *
+ *   eigenfaces_benchmark --images 2000 --labels 100 --json result.json
+ */
+
+#include "databasearchive.hpp"
+#include "eigenfaces.hpp"
+#include "facedatabase.hpp"
+#include "facestore.hpp"
+#include "helper.hpp"
+#include "preprocessor.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+    struct Options {
+        int images;
+        int labels;
+        int width;
+        int height;
+        int components;
+        int queries;
+        int repetitions;
+        std::string json;
+
+        Options() : images(1000), labels(50), width(92), height(112), components(50),
+            queries(500), repetitions(3) {
+        }
+    };
+
+    struct Result {
+        std::string name;
+        int items; // items processed per iteration
+        std::vector<double> seconds; // one entry per iteration
+    };
+
+    double elapsed(int64 start) {
+        return (getTickCount() - start) / getTickFrequency();
+    }
+
+    double percentile(std::vector<double> sorted, double p) {
+        if (sorted.empty())
+            return 0;
+        std::sort(sorted.begin(), sorted.end());
+        size_t i = (size_t) (p * (sorted.size() - 1) + 0.5);
+        return sorted[i];
+    }
+
+    double mean(const std::vector<double>& values) {
+        double sum = 0;
+        for (size_t i = 0; i < values.size(); i++)
+            sum += values[i];
+        return values.empty() ? 0 : sum / values.size();
+    }
+
+    std::string jsonString(const std::string& s) {
+        std::string result = "\"";
+        for (size_t i = 0; i < s.size(); i++) {
+            if (s[i] == '"' || s[i] == '\\')
+                result += '\\';
+            result += s[i];
+        }
+        return result + "\"";
+    }
+
+    void report(const Result& r, std::ostream& os) {
+        double m = mean(r.seconds);
+        char line[256];
+        snprintf(line, sizeof (line), "%-28s %8d it %12.2f us mean %12.2f p50 %12.2f p90 %12.2f p99 %14.1f items/s",
+                r.name.c_str(), (int) r.seconds.size(), m * 1e6,
+                percentile(r.seconds, 0.5) * 1e6, percentile(r.seconds, 0.9) * 1e6,
+                percentile(r.seconds, 0.99) * 1e6, m > 0 ? r.items / m : 0.0);
+        os << line << std::endl;
+    }
+
+    void writeJson(const Options& o, const std::vector<Result>& results, std::ostream& os) {
+        os << "{\n  \"context\": {"
+                << "\"images\": " << o.images
+                << ", \"labels\": " << o.labels
+                << ", \"width\": " << o.width
+                << ", \"height\": " << o.height
+                << ", \"components\": " << o.components
+                << ", \"queries\": " << o.queries
+                << ", \"threads\": " << getNumThreads()
+                << "},\n  \"benchmarks\": [\n";
+        for (size_t i = 0; i < results.size(); i++) {
+            const Result& r = results[i];
+            double m = mean(r.seconds);
+            os << "    {\"name\": " << jsonString(r.name)
+                    << ", \"iterations\": " << r.seconds.size()
+                    << ", \"mean_us\": " << m * 1e6
+                    << ", \"p50_us\": " << percentile(r.seconds, 0.5) * 1e6
+                    << ", \"p90_us\": " << percentile(r.seconds, 0.9) * 1e6
+                    << ", \"p99_us\": " << percentile(r.seconds, 0.99) * 1e6
+                    << ", \"items_per_second\": " << (m > 0 ? r.items / m : 0.0)
+                    << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+        }
+        os << "  ]\n}\n";
+    }
+
+    bool parse(int argc, char** argv, Options& o) {
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            if (i + 1 >= argc)
+                return false;
+            std::string value = argv[++i];
+            if (arg == "--images")
+                o.images = atoi(value.c_str());
+            else if (arg == "--labels")
+                o.labels = atoi(value.c_str());
+            else if (arg == "--width")
+                o.width = atoi(value.c_str());
+            else if (arg == "--height")
+                o.height = atoi(value.c_str());
+            else if (arg == "--components")
+                o.components = atoi(value.c_str());
+            else if (arg == "--queries")
+                o.queries = atoi(value.c_str());
+            else if (arg == "--repetitions")
+                o.repetitions = atoi(value.c_str());
+            else if (arg == "--json")
+                o.json = value;
+            else
+                return false;
+        }
+        return o.images > 1 && o.labels > 0 && o.width > 0 && o.height > 0
+                && o.components > 0 && o.queries > 0 && o.repetitions > 0;
+    }
+
+    //! a random face per label, every image of it with added noise
+    void makeGallery(const Options& o, RNG& rng, FaceStore& gallery, std::vector<Mat>& queries) {
+        std::vector<Mat> bases(o.labels);
+        for (int label = 0; label < o.labels; label++) {
+            Mat small(o.height / 8 + 1, o.width / 8 + 1, CV_8U);
+            rng.fill(small, RNG::UNIFORM, Scalar::all(0), Scalar::all(256));
+            // smooth faces make the spectrum decay like real ones
+            resize(small, bases[label], Size(o.width, o.height));
+        }
+        for (int i = 0; i < o.images + o.queries; i++) {
+            int label = i % o.labels;
+            Mat noise(o.height, o.width, CV_16S), image;
+            rng.fill(noise, RNG::NORMAL, Scalar::all(0), Scalar::all(20));
+            add(bases[label], noise, image, noArray(), CV_8U);
+            if (i < o.images)
+                gallery.add(image, "label" + num2str(label));
+            else
+                queries.push_back(image);
+        }
+    }
+
+    //! times one search configuration of model over all queries
+    Result timePredict(const std::string& name, const Eigenfaces& model, const std::vector<Mat>& queries) {
+        Result r;
+        r.name = name;
+        r.items = 1;
+        Eigenfaces::Workspace ws;
+        double dist;
+        for (size_t i = 0; i < queries.size(); i++) {
+            int64 start = getTickCount();
+            model.predict(queries[i], dist, ws);
+            r.seconds.push_back(elapsed(start));
+        }
+        return r;
+    }
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Options o;
+    if (!parse(argc, argv, o)) {
+        std::cerr << "usage: " << argv[0] << " [--images n] [--labels n] [--width n] [--height n]"
+                << " [--components n] [--queries n] [--repetitions n] [--json file]" << std::endl;
+        return 1;
+    }
+    RNG rng(12345);
+    FaceStore gallery;
+    std::vector<Mat> queries;
+    makeGallery(o, rng, gallery, queries);
+    std::vector<Result> results;
+
+    // PCA solvers
+    const char* solverNames[] = {"compute/opencv", "compute/snapshot", "compute/randomized",
+        "compute/streaming"};
+    Eigenfaces::Solver solvers[] = {Eigenfaces::SOLVER_OPENCV, Eigenfaces::SOLVER_SNAPSHOT,
+        Eigenfaces::SOLVER_RANDOMIZED, Eigenfaces::SOLVER_STREAMING};
+    Eigenfaces model;
+    for (int s = 0; s < 4; s++) {
+        Result r;
+        r.name = solverNames[s];
+        r.items = o.images;
+        for (int rep = 0; rep < o.repetitions; rep++) {
+            Eigenfaces e(o.components);
+            e.setSolver(solvers[s]);
+            int64 start = getTickCount();
+            e.compute(gallery.images(), gallery.labels());
+            r.seconds.push_back(elapsed(start));
+            if (s == 1)
+                model = e;
+        }
+        results.push_back(r);
+    }
+
+    // single sample projection and reconstruction
+    Result project, reconstruct;
+    project.name = "project";
+    reconstruct.name = "reconstruct";
+    project.items = reconstruct.items = 1;
+    for (size_t i = 0; i < queries.size(); i++) {
+        int64 start = getTickCount();
+        Mat y = model.project(queries[i].reshape(1, 1));
+        project.seconds.push_back(elapsed(start));
+        start = getTickCount();
+        Mat x = model.reconstruct(y);
+        reconstruct.seconds.push_back(elapsed(start));
+    }
+    results.push_back(project);
+    results.push_back(reconstruct);
+
+    // search variants, each on its own copy of the model
+    results.push_back(timePredict("predict/flat", model, queries));
+    Eigenfaces indexed(model);
+    indexed.setIndex((int) std::sqrt((double) o.images));
+    results.push_back(timePredict("predict/ivf", indexed, queries));
+    Eigenfaces int8(model);
+    int8.setQuantization(QuantizedGallery::INT8, 32);
+    results.push_back(timePredict("predict/int8", int8, queries));
+    Eigenfaces fp16(model);
+    fp16.setQuantization(QuantizedGallery::FP16, 32);
+    results.push_back(timePredict("predict/fp16", fp16, queries));
+    Eigenfaces prototypes(model);
+    prototypes.setPrototypes(4, PrototypeIndex::KMEANS, 0.1);
+    results.push_back(timePredict("predict/prototypes", prototypes, queries));
+    // galleries below a few thousand images are searched unsharded anyway
+    Eigenfaces sharded(model);
+    sharded.setShards(getNumThreads());
+    results.push_back(timePredict("predict/sharded", sharded, queries));
+    Eigenfaces cascade(model);
+    cascade.setCascade(8);
+    results.push_back(timePredict("predict/cascade", cascade, queries));
+
+    Result topK;
+    topK.name = "predictTopK/5";
+    topK.items = 1;
+    std::vector<std::string> labels;
+    std::vector<double> dists;
+    for (size_t i = 0; i < queries.size(); i++) {
+        int64 start = getTickCount();
+        model.predictTopK(queries[i], 5, false, labels, dists);
+        topK.seconds.push_back(elapsed(start));
+    }
+    results.push_back(topK);
+
+    Result batch;
+    batch.name = "predict/batch";
+    batch.items = queries.size();
+    for (int rep = 0; rep < o.repetitions; rep++) {
+        int64 start = getTickCount();
+        model.predict(queries, labels, dists);
+        batch.seconds.push_back(elapsed(start));
+    }
+    results.push_back(batch);
+
+    // databases as saveData and loadData write and read them, binary and XML
+    const char* formats[] = {"", "/xml"};
+    const char* fileNames[] = {"eigenfaces_benchmark.db", "eigenfaces_benchmark.xml"};
+    DatabaseArchive archive;
+    archive.faceWidth = o.width;
+    archive.faceHeight = o.height;
+    archive.numComponents = o.components;
+    archive.faces = gallery;
+    archive.model = EigenfacesPtr(new Eigenfaces(model));
+    for (int f = 0; f < 2; f++) {
+        Result write, load;
+        write.name = std::string("database/write") + formats[f];
+        load.name = std::string("database/load") + formats[f];
+        write.items = load.items = o.images;
+        for (int rep = 0; rep < o.repetitions; rep++) {
+            int64 start = getTickCount();
+            archive.write(fileNames[f]);
+            write.seconds.push_back(elapsed(start));
+            start = getTickCount();
+            {
+                DatabaseArchive loaded;
+                loaded.read(fileNames[f]);
+            }
+            load.seconds.push_back(elapsed(start));
+        }
+        std::remove(fileNames[f]);
+        results.push_back(write);
+        results.push_back(load);
+    }
+
+    // preprocessing of a VGA camera frame
+    Mat frame(480, 640, CV_8UC3);
+    rng.fill(frame, RNG::UNIFORM, Scalar::all(0), Scalar::all(256));
+    Result fused, separate;
+    fused.name = "preprocess/fused";
+    separate.name = "preprocess/cvtColor+resize";
+    fused.items = separate.items = 1;
+    FacePreprocessor preprocessor;
+    Mat centered, grey, face, sample;
+    Mat meanRow = model.mean().reshape(1, 1);
+    for (size_t i = 0; i < queries.size(); i++) {
+        int64 start = getTickCount();
+        preprocessor.apply(frame.data, frame.cols, frame.rows, 3, frame.step,
+                Size(o.width, o.height), meanRow, centered);
+        fused.seconds.push_back(elapsed(start));
+        start = getTickCount();
+        cvtColor(frame, grey, CV_RGB2GRAY);
+        resize(grey, face, Size(o.width, o.height));
+        face.reshape(1, 1).convertTo(sample, meanRow.type());
+        subtract(sample, meanRow, centered);
+        separate.seconds.push_back(elapsed(start));
+    }
+    results.push_back(fused);
+    results.push_back(separate);
+
+    for (size_t i = 0; i < results.size(); i++)
+        report(results[i], std::cout);
+    if (!o.json.empty()) {
+        std::ofstream ofs(o.json.c_str());
+        writeJson(o, results, ofs);
+        if (!ofs) {
+            std::cerr << "cannot write " << o.json << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
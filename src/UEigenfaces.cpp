@@ -23,14 +23,75 @@
 
 #include "UEigenfaces.h"
 #include <iostream>
+#include <algorithm>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
 #include <boost/foreach.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/thread.hpp>
+#include <ctime>
 #include <fstream>
+#include <limits>
 
 
 using namespace std;
 using namespace urbi;
 
-UEigenfaces::UEigenfaces(const std::string& name) : UObject(name), eigenfaces(NULL) {
+namespace {
+
+    // trained images searched to compare the compressed search to the exact one
+    const int QUANTIZATION_SAMPLES = 200;
+    // requests queued by findAsync() before the oldest are dropped, also the
+    // results preallocated, more are allocated when update() falls behind
+    const int DEFAULT_ASYNC_QUEUE = 64;
+    // milliseconds between the publications of the findAsync() results
+    const double ASYNC_POLL_PERIOD = 10;
+
+    double secondsSince(int64 start) {
+        return (cv::getTickCount() - start) / cv::getTickFrequency();
+    }
+
+    // worker of a bulk training, decodes the files until none is left
+    struct ImageDecoder {
+        const std::vector<std::string>& files;
+        std::vector<cv::Mat>& images;
+        cv::Size size;
+        boost::atomic<int>& next;
+
+        ImageDecoder(const std::vector<std::string>& files, std::vector<cv::Mat>& images,
+                cv::Size size, boost::atomic<int>& next) :
+            files(files), images(images), size(size), next(next) {
+        }
+
+        void operator()() const {
+            for (int i = next.fetch_add(1); i < (int) files.size(); i = next.fetch_add(1)) {
+                // unreadable files are left empty and skipped
+                try {
+                    cv::Mat image = cv::imread(files[i], 0);
+                    if (image.empty())
+                        continue;
+                    if (image.size() != size)
+                        cv::resize(image, image, size);
+                    images[i] = image;
+                } catch (const cv::Exception&) {
+                }
+            }
+        }
+    };
+
+} // namespace
+
+UEigenfaces::UEigenfaces(const std::string& name) : UObject(name), facesGeneration(0),
+    snapshotFaces(0), journaling(false), journalCompactAfter(0), compacting(false),
+    distMean(0), numComponents(0), thresh(0), indexLists(0), indexProbes(8), searchShards(1), cascadeComponents(0), incremental(false), driftBound(0.05),
+    pcaSolver(Eigenfaces::SOLVER_AUTO), quantization(QuantizedGallery::NONE),
+    prototypesPerLabel(0), prototypeMethod(PrototypeIndex::KMEANS), prototypeMargin(0.1), rerankCandidates(32),
+    findThreads(boost::thread::hardware_concurrency()),
+    activeFinds(0), findAllocations(0), faceSpaceThresh(0), trackRadius(0.05), trackWindow(5), trackTimeout(2.0),
+    statsPeriod(0), lastStatsDump(0), asyncResults(DEFAULT_ASYNC_QUEUE), asyncRunning(false), asyncDisabled(false), asyncStop(false) {
+    if (findThreads < 1)
+        findThreads = 1;
     cerr << "[UEigenfaces]::UEigenfaces()" << endl;
     UBindFunction(UEigenfaces, init);
     faceWidth = 92;
@@ -38,6 +99,12 @@ UEigenfaces::UEigenfaces(const std::string& name) : UObject(name), eigenfaces(NU
 }
 
 UEigenfaces::~UEigenfaces() {
+    if (compactor.joinable())
+        compactor.join();
+    stopAsync();
+    AsyncResult* result;
+    while (asyncResults.pop(result))
+        delete result;
     cerr << "[UEigenfaces]::~UEigenfaces()" << endl;
 }
 
@@ -47,9 +114,20 @@ void UEigenfaces::init(int i) {
     // Bind all functions
     UBindThreadedFunction(UEigenfaces, loadData, LOCK_INSTANCE);
     UBindThreadedFunction(UEigenfaces, saveData, LOCK_INSTANCE);
+    UBindThreadedFunction(UEigenfaces, convertData, LOCK_INSTANCE);
+    UBindThreadedFunction(UEigenfaces, setJournal, LOCK_INSTANCE);
+    UBindFunction(UEigenfaces, compactJournal);
     UBindThreadedFunction(UEigenfaces, train, LOCK_INSTANCE);
-    UBindThreadedFunction(UEigenfaces, updateDatabase, LOCK_INSTANCE);
-    UBindFunction(UEigenfaces, find);
+    UBindThreadedFunction(UEigenfaces, trainFromDirectory, LOCK_INSTANCE);
+    UBindThreadedFunction(UEigenfaces, trainFromCsv, LOCK_INSTANCE);
+    // retraining works on a snapshot of the faces and does not block train
+    UBindThreadedFunction(UEigenfaces, updateDatabase, LOCK_FUNCTION);
+    // recognition only reads the published model, calls run in parallel
+    UBindThreadedFunction(UEigenfaces, find, LOCK_NONE);
+    UBindThreadedFunction(UEigenfaces, findBatch, LOCK_NONE);
+    UBindThreadedFunction(UEigenfaces, findTopK, LOCK_NONE);
+    UBindThreadedFunction(UEigenfaces, findTracked, LOCK_NONE);
+    UBindFunction(UEigenfaces, setTracking);
     UBindFunction(UEigenfaces, getFacesCount);
     UBindFunction(UEigenfaces, getFacesNames);
     UBindFunction(UEigenfaces, getFaceImagesCount);
@@ -59,156 +137,716 @@ void UEigenfaces::init(int i) {
     UBindFunction(UEigenfaces, getTestFace);
     UBindFunction(UEigenfaces, getThreshold);
     UBindFunction(UEigenfaces, setThreshold);
+    UBindFunction(UEigenfaces, getFaceSpaceThreshold);
+    UBindFunction(UEigenfaces, setFaceSpaceThreshold);
+    UBindThreadedFunction(UEigenfaces, setIndex, LOCK_FUNCTION);
+    UBindThreadedFunction(UEigenfaces, setIndexProbes, LOCK_FUNCTION);
+    UBindThreadedFunction(UEigenfaces, setShards, LOCK_FUNCTION);
+    UBindThreadedFunction(UEigenfaces, setCascade, LOCK_FUNCTION);
+    UBindFunction(UEigenfaces, setIncremental);
+    UBindFunction(UEigenfaces, setDriftBound);
+    UBindFunction(UEigenfaces, setSolver);
+    UBindThreadedFunction(UEigenfaces, setQuantization, LOCK_FUNCTION);
+    UBindThreadedFunction(UEigenfaces, setPrototypes, LOCK_FUNCTION);
+    UBindFunction(UEigenfaces, setFindThreads);
+    UBindFunction(UEigenfaces, getFindAllocations);
+    UBindFunction(UEigenfaces, getStats);
+    UBindFunction(UEigenfaces, resetStats);
+    UBindFunction(UEigenfaces, setStatsDump);
+    UBindFunction(UEigenfaces, findAsync);
+    UBindFunction(UEigenfaces, setAsync);
+    UBindVar(UEigenfaces, lastResult);
+    UBindEvent(UEigenfaces, found);
 }
 
 bool UEigenfaces::loadData(const std::string& fileName) {
-    ifstream ifs(fileName.c_str());
-
-    boost::archive::xml_iarchive ia(ifs);
+    boost::mutex::scoped_lock modelLock(modelMutex);
+    DatabaseArchive archive;
+    archive.read(fileName);
+    EigenfacesPtr loaded = archive.model;
+    {
+        boost::mutex::scoped_lock facesLock(facesMutex);
+        faceWidth = archive.faceWidth;
+        faceHeight = archive.faceHeight;
+        numComponents = archive.numComponents;
+        thresh = archive.threshold;
+        faces = archive.faces;
+        database = archive.database;
+        facesGeneration++;
+        snapshotFile = fileName;
+        snapshotFaces = faces.size();
+        if (journaling)
+            openJournal();
+        // faces replayed from the journal are not in the stored model
+        if (loaded && loaded->num_samples() != (int) faces.size()) {
+            if (incremental) {
+                foldFaces(*loaded);
+            } else {
+                cerr << "[UEigenfaces]::loadData() : " << faces.size() - loaded->num_samples()
+                        << " faces replayed from the journal" << endl;
+                loaded.reset();
+            }
+        }
+    }
 
-    // Uzupełnienie facesWidth, facesHeight, faces z pliku fileName
-    ia >> boost::serialization::make_nvp("UEigenfaces", *this);
+    // retrain only if the file has no model or it is stale
+    if (!loaded) {
+        cerr << "[UEigenfaces]::loadData() : no valid model stored, retraining" << endl;
+        FaceStore snapshot;
+        {
+            boost::mutex::scoped_lock facesLock(facesMutex);
+            snapshot = faces;
+        }
+        loaded = computeModel(snapshot);
+    }
+    configureModel(*loaded);
+    double dist;
+    loaded->predict(loaded->mean(), dist);
+    distMean = dist;
+    publishModel(loaded);
+    cout << "distMean = " << dist << endl;
 
-    std::vector<std::string> labels;
-    std::vector<cv::Mat> images;
+    return true;
+}
 
-    BOOST_FOREACH(FacePair p, faces) {
-        images.push_back(p.first);
-        labels.push_back(p.second);
+bool UEigenfaces::saveData(const std::string& fileName) {
+    boost::mutex::scoped_lock snapshotLock(snapshotMutex);
+    boost::mutex::scoped_lock facesLock(facesMutex);
+    writeSnapshot(fileName, faces);
+    // the journal follows the database just written and starts empty
+    snapshotFile = fileName;
+    snapshotFaces = faces.size();
+    if (journaling) {
+        journal.reset();
+        FaceJournal::write(snapshotFile + ".journal", faces.size(), faces);
+        journal.reset(new FaceJournal(snapshotFile + ".journal", faces.size()));
     }
+    return true;
+}
 
-    eigenfaces = new Eigenfaces(images, labels, numComponents);
-    std::string predicted = eigenfaces->predict(eigenfaces->mean(), distMean);
-    cout << "distMean = " << distMean << endl;
+void UEigenfaces::writeSnapshot(const std::string& fileName, const FaceStore& snapshot) const {
+    DatabaseArchive archive;
+    archive.faceWidth = faceWidth;
+    archive.faceHeight = faceHeight;
+    archive.numComponents = numComponents;
+    archive.threshold = thresh;
+    archive.faces = snapshot;
+    archive.model = model();
+    archive.write(fileName);
+}
 
-    return true;
+void UEigenfaces::setJournal(bool enable, int compactAfter) {
+    boost::mutex::scoped_lock facesLock(facesMutex);
+    journalCompactAfter = compactAfter;
+    if (enable == journaling)
+        return;
+    journaling = enable;
+    if (!enable)
+        journal.reset();
+    else if (!snapshotFile.empty())
+        openJournal();
+}
+
+void UEigenfaces::openJournal() {
+    std::string journalFile = snapshotFile + ".journal";
+    size_t replayed = FaceJournal::replay(journalFile, faces);
+    if (replayed > 0)
+        cout << "[UEigenfaces]::openJournal() : " << replayed << " faces replayed from " << journalFile << endl;
+    journal.reset(new FaceJournal(journalFile, snapshotFaces));
+    // faces trained since the snapshot while the journal was off are added to it
+    if (journal->baseFaces() + journal->records() != faces.size()) {
+        journal.reset();
+        FaceJournal::write(journalFile, snapshotFaces, faces);
+        journal.reset(new FaceJournal(journalFile, snapshotFaces));
+    }
 }
 
-bool UEigenfaces::saveData(const std::string& fileName) const {
-    ofstream ofs(fileName.c_str());
+bool UEigenfaces::compactJournal() {
+    if (compacting.exchange(true))
+        return false;
+    if (compactor.joinable())
+        compactor.join();
+    compactor = boost::thread(&UEigenfaces::compact, this);
+    return true;
+}
 
-    boost::archive::xml_oarchive oa(ofs);
-    oa << boost::serialization::make_nvp("UEigenfaces", *this);
+void UEigenfaces::compact() {
+    try {
+        boost::mutex::scoped_lock snapshotLock(snapshotMutex);
+        std::string fileName;
+        FaceStore snapshot;
+        boost::shared_ptr<FaceDatabase> snapshotDatabase;
+        unsigned generation;
+        {
+            boost::mutex::scoped_lock facesLock(facesMutex);
+            if (!journal) {
+                compacting = false;
+                return;
+            }
+            fileName = snapshotFile;
+            generation = facesGeneration;
+            // written from a snapshot so that training goes on meanwhile
+            snapshot = faces;
+            snapshotDatabase = database;
+        }
+        writeSnapshot(fileName, snapshot);
+        // keep only the faces trained since the snapshot was taken
+        boost::mutex::scoped_lock facesLock(facesMutex);
+        if (generation == facesGeneration && fileName == snapshotFile && journal) {
+            snapshotFaces = snapshot.size();
+            journal.reset();
+            FaceJournal::write(fileName + ".journal", snapshot.size(), faces);
+            journal.reset(new FaceJournal(fileName + ".journal", snapshot.size()));
+        }
+    } catch (const std::exception& e) {
+        cerr << "[UEigenfaces]::compact() : " << e.what() << endl;
+    }
+    compacting = false;
+}
 
+bool UEigenfaces::convertData(const std::string& srcFileName, const std::string& dstFileName) {
+    // file to file, the faces and the model of the module are left alone
+    DatabaseArchive archive;
+    archive.read(srcFileName);
+    archive.write(dstFileName);
     return true;
 }
 
 bool UEigenfaces::train(urbi::UImage src, const std::string& name) {
-    uchar channel_type;
-    if (src.imageFormat == IMAGE_GREY8) {
-        channel_type = CV_8UC1;
-    } else if (src.imageFormat == IMAGE_RGB) {
-        channel_type = CV_8UC3;
-    } else {
-        throw std::runtime_error("[UEigenfaces]::find() : Unsupported image format: ");
+    cv::Mat newFace = prepareFace(src);
+    bool compactNow = false;
+    {
+        boost::mutex::scoped_lock facesLock(facesMutex);
+        // journaled in the order of faces, the replay relies on it; a face
+        // the journal could not take is not trained
+        if (journal) {
+            journal->append(newFace, name);
+            compactNow = journalCompactAfter > 0 && (int) journal->records() >= journalCompactAfter;
+        }
+        faces.add(newFace, name);
     }
-    cv::Mat testSample(cv::Size(src.width, src.height), channel_type, src.data);
-    if (channel_type == CV_8UC3)
-        cvtColor(testSample, testSample, CV_RGB2GRAY);
-    cv::resize(testSample, testSample, cv::Size(faceWidth, faceHeight));
-    FacePair newFace = make_pair(testSample, name);
-    faces.push_back(newFace);
+    if (compactNow)
+        compactJournal();
+    if (incremental) {
+        boost::mutex::scoped_lock modelLock(modelMutex);
+        EigenfacesPtr current = model();
+        if (!current)
+            return true;
+        // update a copy, find keeps using the current model meanwhile
+        EigenfacesPtr updated = holdModel(new Eigenfaces(*current), database);
+        {
+            // the face may be in the model already, folded by updateDatabase
+            // or by another train since it was added
+            boost::mutex::scoped_lock facesLock(facesMutex);
+            foldFaces(*updated);
+        }
+        if (updated->num_samples() == current->num_samples())
+            return true;
+        if (updated->drift() > driftBound) {
+            cerr << "[UEigenfaces]::train() : drift = " << updated->drift() << ", recomputing" << endl;
+            FaceStore snapshot;
+            {
+                boost::mutex::scoped_lock facesLock(facesMutex);
+                snapshot = faces;
+            }
+            updated = computeModel(snapshot);
+            configureModel(*updated);
+        }
+        publishModel(updated);
+    }
+    return true;
 }
 
-bool UEigenfaces::updateDatabase(int components) {
-    std::vector<std::string> labels;
-    std::vector<cv::Mat> images;
+int UEigenfaces::trainFromDirectory(const std::string& path, bool update) {
+    namespace fs = boost::filesystem;
+    if (!fs::is_directory(path))
+        throw std::runtime_error("[UEigenfaces]::trainFromDirectory() : Not a directory: " + path);
+    // sorted, so that the images are added in the same order every time
+    std::vector<fs::path> labelDirs;
+    for (fs::directory_iterator it(path); it != fs::directory_iterator(); ++it) {
+        if (fs::is_directory(it->status()))
+            labelDirs.push_back(it->path());
+    }
+    std::sort(labelDirs.begin(), labelDirs.end());
+    std::vector<std::string> files, labels;
+    BOOST_FOREACH(const fs::path& dir, labelDirs) {
+        std::vector<fs::path> images;
+        for (fs::directory_iterator it(dir); it != fs::directory_iterator(); ++it) {
+            if (fs::is_regular_file(it->status()))
+                images.push_back(it->path());
+        }
+        std::sort(images.begin(), images.end());
+        BOOST_FOREACH(const fs::path& image, images) {
+            files.push_back(image.string());
+            labels.push_back(dir.filename().string());
+        }
+    }
+    return trainFiles(files, labels, update);
+}
 
-    numComponents = components;
-    if (eigenfaces)
-        delete eigenfaces;
+int UEigenfaces::trainFromCsv(const std::string& fileName, bool update) {
+    std::ifstream ifs(fileName.c_str());
+    if (!ifs)
+        throw std::runtime_error("[UEigenfaces]::trainFromCsv() : Cannot open " + fileName);
+    boost::filesystem::path base = boost::filesystem::path(fileName).parent_path();
+    std::vector<std::string> files, labels;
+    std::string line;
+    for (int lineNumber = 1; std::getline(ifs, line); lineNumber++) {
+        if (!line.empty() && line[line.size() - 1] == '\r')
+            line.erase(line.size() - 1);
+        if (line.empty())
+            continue;
+        size_t separator = line.rfind(';');
+        if (separator == std::string::npos || separator == 0 || separator + 1 == line.size())
+            throw std::runtime_error("[UEigenfaces]::trainFromCsv() : Invalid line " + num2str(lineNumber)
+                + " of " + fileName);
+        boost::filesystem::path file(line.substr(0, separator));
+        files.push_back(file.is_absolute() ? file.string() : (base / file).string());
+        labels.push_back(line.substr(separator + 1));
+    }
+    return trainFiles(files, labels, update);
+}
+
+int UEigenfaces::trainFiles(const std::vector<std::string>& files, const std::vector<std::string>& labels,
+        bool update) {
+    int64 start = cv::getTickCount();
+    std::vector<cv::Mat> images(files.size());
+    boost::atomic<int> next(0);
+    boost::thread_group workers;
+    int threads = std::min<int>(std::max(1u, boost::thread::hardware_concurrency()), files.size());
+    for (int i = 0; i < threads; i++)
+        workers.create_thread(ImageDecoder(files, images, cv::Size(faceWidth, faceHeight), next));
+    workers.join_all();
+    // one batch, find and train wait for the lock only once
+    int added = 0;
+    bool compactNow = false;
+    {
+        FaceStore batch;
+        batch.reserve(files.size());
+        for (size_t i = 0; i < files.size(); i++) {
+            if (!images[i].empty())
+                batch.add(images[i], labels[i]);
+        }
+        boost::mutex::scoped_lock facesLock(facesMutex);
+        // the journal takes the whole batch or none of it, faces follow it
+        if (journal) {
+            journal->append(batch, 0, batch.size());
+            compactNow = journalCompactAfter > 0 && (int) journal->records() >= journalCompactAfter;
+        }
+        faces.reserve(faces.size() + batch.size());
+        for (size_t i = 0; i < batch.size(); i++)
+            faces.add(batch.image(i), batch.label(i));
+        added = batch.size();
+    }
+    if (compactNow)
+        compactJournal();
+    if (added < (int) files.size())
+        cerr << "[UEigenfaces]::trainFiles() : " << files.size() - added << " images could not be read" << endl;
+    double seconds = secondsSince(start);
+    cout << "[UEigenfaces]::trainFiles() : " << added << " images in " << seconds << " s, "
+            << (seconds > 0 ? added / seconds : 0) << " images/s" << endl;
+    if (update && added > 0)
+        updateDatabase(numComponents);
+    return added;
+}
 
-    BOOST_FOREACH(FacePair p, faces) {
-        cv::Mat tmp = Mat(cv::Size(p.first.cols, p.first.rows), p.first.type(), p.first.data);
-        images.push_back(tmp);
-        labels.push_back(p.second);
+bool UEigenfaces::updateDatabase(int components) {
+    FaceStore snapshot;
+    boost::shared_ptr<FaceDatabase> snapshotDatabase;
+    unsigned generation;
+    {
+        boost::mutex::scoped_lock facesLock(facesMutex);
+        snapshot = faces;
+        // the snapshot may point into the mapping, keep it alive
+        snapshotDatabase = database;
+        generation = facesGeneration;
     }
-    eigenfaces = new Eigenfaces(images, labels, numComponents);
-    eigenfaces->predict(eigenfaces->mean(), distMean);
-    thresh = distMean;
-    cout << "distMean = " << distMean << endl;
+    numComponents = components;
+    double dist;
+    // no lock is held here, find keeps using the current model
+    EigenfacesPtr updated = computeModel(snapshot);
+    configureModel(*updated);
+    {
+        boost::mutex::scoped_lock modelLock(modelMutex);
+        boost::mutex::scoped_lock facesLock(facesMutex);
+        if (generation != facesGeneration) {
+            cerr << "[UEigenfaces]::updateDatabase() : database loaded meanwhile, model discarded" << endl;
+            return false;
+        }
+        // faces added to the previous model by incremental training
+        if (incremental)
+            foldFaces(*updated);
+        // the threshold of the model is in place before find can use it
+        updated->predict(updated->mean(), dist);
+        distMean = dist;
+        thresh = dist;
+        publishModel(updated);
+    }
+    cout << "distMean = " << dist << endl;
+    return true;
+}
+
+EigenfacesPtr UEigenfaces::model() const {
+    return boost::atomic_load(&eigenfaces);
+}
+
+void UEigenfaces::publishModel(EigenfacesPtr model) {
+    boost::atomic_store(&eigenfaces, model);
+    stats.modelPublished();
+}
+
+EigenfacesPtr UEigenfaces::holdModel(Eigenfaces* model, boost::shared_ptr<FaceDatabase> db) const {
+    if (!model)
+        return EigenfacesPtr();
+    return EigenfacesPtr(model, DatabaseHolder(db));
+}
+
+EigenfacesPtr UEigenfaces::computeModel(const FaceStore& snapshot) const {
+    EigenfacesPtr model(new Eigenfaces(numComponents));
+    model->setSolver(static_cast<Eigenfaces::Solver> (pcaSolver));
+    model->compute(snapshot.images(), snapshot.labels());
+    cerr << "[UEigenfaces]::computeModel() : solver = " << model->solver()
+            << " time = " << model->compute_time() << " s"
+            << " reconstruction error = " << model->reconstruction_error() << endl;
+    return model;
+}
+
+void UEigenfaces::configureModel(Eigenfaces& model) const {
+    model.setProbes(indexProbes);
+    model.setShards(searchShards);
+    model.setCascade(cascadeComponents);
+    model.setIndex(indexLists);
+    model.setQuantization(static_cast<QuantizedGallery::Type> (quantization), rerankCandidates);
+    model.setPrototypes(prototypesPerLabel, static_cast<PrototypeIndex::Method> (prototypeMethod),
+            prototypeMargin);
+}
+
+void UEigenfaces::foldFaces(Eigenfaces& model) const {
+    for (size_t i = model.num_samples(); i < faces.size(); i++)
+        model.update(faces.image(i), faces.label(i));
 }
 
 std::string UEigenfaces::find(urbi::UImage src) const {
-    uchar channel_type;
     double dist;
+    return findFace(src, dist);
+}
+
+std::string UEigenfaces::findFace(const urbi::UImage& src, double& dist) const {
     std::string predicted;
+    int64 start = cv::getTickCount();
+    stats.call();
+    FindSlot slot(*this);
+    FindScratch& buffers = findScratch();
+    EigenfacesPtr current = model();
+    if (!current)
+        throw std::runtime_error("[UEigenfaces]::find() : Database not updated");
+    dist = std::numeric_limits<double>::max();
+    unsigned allocations = buffers.allocations();
+    int64 preprocessStart = cv::getTickCount();
+    centerFace(src, *current, buffers);
+    stats.record(RecognitionStats::PREPROCESS, secondsSince(preprocessStart));
+    int64 projectStart = cv::getTickCount();
+    current->project(buffers.workspace.centered, buffers.workspace);
+    stats.record(RecognitionStats::PROJECT, secondsSince(projectStart));
+    // false detections are rejected before the database is searched
+    bool face = isFace(*current, buffers.workspace);
+    if (face) {
+        predicted = current->predictProjected(dist, buffers.workspace);
+        stats.record(RecognitionStats::SEARCH, buffers.workspace.search_time);
+    }
+    int64 thresholdStart = cv::getTickCount();
+    if (buffers.allocations() != allocations) {
+        boost::mutex::scoped_lock findLock(findMutex);
+        findAllocations += buffers.allocations() - allocations;
+    }
+    // rejections are counted, printing each one would cost more than the search
+    if (!face) {
+        predicted = "";
+    } else if (dist > thresh) {
+        stats.rejection();
+        predicted = "";
+    }
+    stats.record(RecognitionStats::THRESHOLD, secondsSince(thresholdStart));
+    stats.record(RecognitionStats::TOTAL, secondsSince(start));
+    return predicted;
+}
+
+urbi::UList UEigenfaces::findBatch(std::vector<urbi::UImage> src) const {
+    std::vector<cv::Mat> samples;
+    std::vector<std::string> predicted;
+    std::vector<double> dists;
+    urbi::UList result;
+    int64 start = cv::getTickCount();
+    // every image counts as a call, as the rejections do
+    for (size_t i = 0; i < src.size(); i++)
+        stats.call();
+    FindSlot slot(*this);
+
+    int64 preprocessStart = cv::getTickCount();
+    BOOST_FOREACH(const urbi::UImage& image, src) {
+        samples.push_back(prepareFace(image));
+    }
+    double preprocessTime = secondsSince(preprocessStart);
+    EigenfacesPtr current = model();
+    if (!current)
+        throw std::runtime_error("[UEigenfaces]::findBatch() : Database not updated");
+    // the projection is part of the batched search
+    int64 searchStart = cv::getTickCount();
+    current->predict(samples, predicted, dists);
+    double searchTime = secondsSince(searchStart);
+    int64 thresholdStart = cv::getTickCount();
+    double threshold = thresh;
+    for (size_t i = 0; i < predicted.size(); i++) {
+        urbi::UList entry;
+        if (dists[i] > threshold) {
+            stats.rejection();
+            predicted[i] = "";
+        }
+        entry.push_back(predicted[i]);
+        entry.push_back(dists[i]);
+        result.push_back(entry);
+    }
+    double thresholdTime = secondsSince(thresholdStart);
+    double totalTime = secondsSince(start);
+    // and takes its share of the batch in every stage
+    for (size_t i = 0; i < samples.size(); i++) {
+        stats.record(RecognitionStats::PREPROCESS, preprocessTime / samples.size());
+        stats.record(RecognitionStats::SEARCH, searchTime / samples.size());
+        stats.record(RecognitionStats::THRESHOLD, thresholdTime / samples.size());
+        stats.record(RecognitionStats::TOTAL, totalTime / samples.size());
+    }
+    return result;
+}
+
+cv::Mat UEigenfaces::prepareFace(const urbi::UImage& src) const {
+    uchar channel_type;
     if (src.imageFormat == IMAGE_GREY8) {
         channel_type = CV_8UC1;
     } else if (src.imageFormat == IMAGE_RGB) {
         channel_type = CV_8UC3;
     } else {
-        throw std::runtime_error("[UEigenfaces]::find() : Unsupported image format: ");
+        throw std::runtime_error("[UEigenfaces]::prepareFace() : Unsupported image format: ");
     }
-    cv::Mat testSample(cv::Size(src.width, src.height), channel_type, src.data);
+    cv::Mat face(cv::Size(src.width, src.height), channel_type, src.data);
     if (channel_type == CV_8UC3)
-        cvtColor(testSample, testSample, CV_RGB2GRAY);
-    cv::resize(testSample, testSample, cv::Size(faceWidth, faceHeight));
-    predicted = eigenfaces->predict(testSample, dist);
-    if (dist > thresh) {
-        cerr << "! predicted = " << predicted << " dist = " << dist << " thresh =  " << thresh << endl;
-        predicted = "";
+        cvtColor(face, face, CV_RGB2GRAY);
+    cv::resize(face, face, cv::Size(faceWidth, faceHeight));
+    // resize is a no-op for images of the right size, never keep a
+    // reference to the image buffer owned by Urbi
+    if (face.data == src.data)
+        face = face.clone();
+    return face;
+}
+
+urbi::UList UEigenfaces::findTopK(urbi::UImage src, int count, bool perLabel) const {
+    std::vector<std::string> predicted;
+    std::vector<double> dists;
+    urbi::UList result;
+    int64 start = cv::getTickCount();
+    stats.call();
+    FindSlot slot(*this);
+    FindScratch& buffers = findScratch();
+    EigenfacesPtr current = model();
+    if (!current)
+        throw std::runtime_error("[UEigenfaces]::findTopK() : Database not updated");
+    int64 preprocessStart = cv::getTickCount();
+    centerFace(src, *current, buffers);
+    stats.record(RecognitionStats::PREPROCESS, secondsSince(preprocessStart));
+    int64 projectStart = cv::getTickCount();
+    current->project(buffers.workspace.centered, buffers.workspace);
+    stats.record(RecognitionStats::PROJECT, secondsSince(projectStart));
+    if (!isFace(*current, buffers.workspace)) {
+        stats.record(RecognitionStats::TOTAL, secondsSince(start));
+        return result;
     }
-    return predicted;
+    int64 searchStart = cv::getTickCount();
+    current->predictTopKProjected(count, perLabel, predicted, dists, buffers.workspace);
+    stats.record(RecognitionStats::SEARCH, secondsSince(searchStart));
+    int64 thresholdStart = cv::getTickCount();
+    // a request is rejected once, like find, when even its nearest result is
+    double threshold = thresh;
+    if (predicted.empty() || dists[0] > threshold)
+        stats.rejection();
+    for (size_t i = 0; i < predicted.size(); i++) {
+        urbi::UList entry;
+        if (dists[i] > threshold)
+            predicted[i] = "";
+        entry.push_back(predicted[i]);
+        entry.push_back(dists[i]);
+        result.push_back(entry);
+    }
+    stats.record(RecognitionStats::THRESHOLD, secondsSince(thresholdStart));
+    stats.record(RecognitionStats::TOTAL, secondsSince(start));
+    return result;
 }
 
-int UEigenfaces::getFacesCount() const {
-    std::vector<std::string> labels2;
+std::string UEigenfaces::findTracked(urbi::UImage src, int track) const {
+    double dist;
+    std::string predicted;
+    int64 start = cv::getTickCount();
+    stats.call();
+    FindSlot slot(*this);
+    FindScratch& buffers = findScratch();
+    Eigenfaces::Workspace& ws = buffers.workspace;
+    EigenfacesPtr current = model();
+    if (!current)
+        throw std::runtime_error("[UEigenfaces]::findTracked() : Database not updated");
+    int64 preprocessStart = cv::getTickCount();
+    centerFace(src, *current, buffers);
+    stats.record(RecognitionStats::PREPROCESS, secondsSince(preprocessStart));
+    int64 projectStart = cv::getTickCount();
+    current->project(ws.centered, ws);
+    stats.record(RecognitionStats::PROJECT, secondsSince(projectStart));
+    if (!isFace(*current, ws)) {
+        stats.record(RecognitionStats::TOTAL, secondsSince(start));
+        return "";
+    }
+
+    // reuse the last result of the track if the face barely moved in face space
+    double threshold = thresh;
+    bool cached = false;
+    {
+        boost::mutex::scoped_lock trackLock(trackMutex);
+        std::map<int, TrackState>::const_iterator it = tracks.find(track);
+        int64 timeout = (int64) (trackTimeout * cv::getTickFrequency());
+        if (it != tracks.end() && cv::getTickCount() - it->second.lastSeen <= timeout
+                && it->second.model.lock() == current
+                && it->second.projection.cols == ws.query.cols
+                && cv::norm(ws.query, it->second.projection, cv::NORM_L2) <= trackRadius * threshold) {
+            predicted = it->second.label;
+            dist = it->second.dist;
+            cached = true;
+        }
+    }
+    if (cached) {
+        stats.cacheHit();
+    } else {
+        predicted = current->predictProjected(dist, ws);
+        stats.record(RecognitionStats::SEARCH, ws.search_time);
+        if (dist > threshold) {
+            stats.rejection();
+            predicted = "";
+        }
+    }
 
-    BOOST_FOREACH(FacePair p, faces) {
-        labels2.push_back(p.second);
+    int64 now = cv::getTickCount();
+    boost::mutex::scoped_lock trackLock(trackMutex);
+    // forget the tracks that ended, this one as well if it was away so long
+    // that its votes may be for another face
+    int64 timeout = (int64) (trackTimeout * cv::getTickFrequency());
+    for (std::map<int, TrackState>::iterator it = tracks.begin(); it != tracks.end();) {
+        if (now - it->second.lastSeen > timeout)
+            tracks.erase(it++);
+        else
+            ++it;
+    }
+    TrackState& state = tracks[track];
+    if (!cached) {
+        state.model = current;
+        ws.query.copyTo(state.projection);
+        state.label = predicted;
+        state.dist = dist;
+    }
+    state.lastSeen = now;
+    state.votes.push_back(predicted);
+    while ((int) state.votes.size() > trackWindow)
+        state.votes.pop_front();
+    // majority of the window, ties go to the most recent label
+    int bestVotes = 0;
+    for (int i = state.votes.size() - 1; i >= 0; i--) {
+        int votes = std::count(state.votes.begin(), state.votes.end(), state.votes[i]);
+        if (votes > bestVotes) {
+            bestVotes = votes;
+            predicted = state.votes[i];
+        }
     }
-    std::sort(labels2.begin(), labels2.end());
-    labels2.erase(std::unique(labels2.begin(), labels2.end()), labels2.end());
-    return labels2.size();
+    stats.record(RecognitionStats::TOTAL, secondsSince(start));
+    return predicted;
 }
 
-std::vector<std::string> UEigenfaces::getFacesNames() {
-    std::vector<std::string> labels2;
+void UEigenfaces::setTracking(double radius, int window, double timeout) {
+    if (radius < 0 || window < 1 || timeout <= 0)
+        throw std::runtime_error("[UEigenfaces]::setTracking() : Invalid parameters");
+    boost::mutex::scoped_lock trackLock(trackMutex);
+    trackRadius = radius;
+    trackWindow = window;
+    trackTimeout = timeout;
+}
 
-    BOOST_FOREACH(FacePair p, faces) {
-        labels2.push_back(p.second);
+bool UEigenfaces::isFace(const Eigenfaces& model, const Eigenfaces::Workspace& ws) const {
+    double threshold = faceSpaceThresh;
+    if (threshold <= 0 || model.faceSpaceDistance(ws) <= threshold)
+        return true;
+    stats.nonFace();
+    return false;
+}
+
+void UEigenfaces::centerFace(const urbi::UImage& src, const Eigenfaces& model, FindScratch& scratch) const {
+    int channels;
+    if (src.imageFormat == IMAGE_GREY8) {
+        channels = 1;
+    } else if (src.imageFormat == IMAGE_RGB) {
+        channels = 3;
+    } else {
+        throw std::runtime_error("[UEigenfaces]::centerFace() : Unsupported image format: ");
     }
-    std::sort(labels2.begin(), labels2.end());
-    labels2.erase(std::unique(labels2.begin(), labels2.end()), labels2.end());
-    return labels2;
+    if (src.size < src.width * src.height * channels)
+        throw std::runtime_error("[UEigenfaces]::centerFace() : Image data too short");
+    // grey, resize, convert and subtract the mean in one pass into the
+    // buffers of this thread
+    scratch.preprocessor.apply(src.data, src.width, src.height, channels, src.width * channels,
+            cv::Size(faceWidth, faceHeight), model.mean(), scratch.workspace.centered);
 }
 
-int UEigenfaces::getFaceImagesCount(const std::string& label) {
-    int index = 0;
-    urbi::UImage result;
-    result.imageFormat = IMAGE_UNKNOWN;
+UEigenfaces::FindScratch& UEigenfaces::findScratch() const {
+    if (!scratch.get())
+        scratch.reset(new FindScratch());
+    return *scratch;
+}
 
-    BOOST_FOREACH(FacePair p, faces) {
-        if (p.second == label)
-            index++;
-    }
-    return index;
+UEigenfaces::FindSlot::FindSlot(const UEigenfaces& owner) : owner(owner) {
+    boost::mutex::scoped_lock findLock(owner.findMutex);
+    while (owner.activeFinds >= owner.findThreads)
+        owner.findSlotFreed.wait(findLock);
+    owner.activeFinds++;
+}
+
+UEigenfaces::FindSlot::~FindSlot() {
+    boost::mutex::scoped_lock findLock(owner.findMutex);
+    owner.activeFinds--;
+    owner.findSlotFreed.notify_one();
+}
+
+int UEigenfaces::getFacesCount() const {
+    boost::mutex::scoped_lock facesLock(facesMutex);
+    return faces.labelCount();
+}
+
+std::vector<std::string> UEigenfaces::getFacesNames() {
+    boost::mutex::scoped_lock facesLock(facesMutex);
+    return faces.sortedNames();
+}
+
+int UEigenfaces::getFaceImagesCount(const std::string& label) {
+    boost::mutex::scoped_lock facesLock(facesMutex);
+    int id = faces.find(label);
+    return id < 0 ? 0 : faces.imagesOf(id).size();
 }
 
 urbi::UImage UEigenfaces::getFaceImage(const std::string& name, int number) {
-    int index = 0;
-    urbi::UImage result;
-    result.imageFormat = IMAGE_UNKNOWN;
-
-    BOOST_FOREACH(FacePair p, faces) {
-        if (p.second == name) {
-            if (index == number) {
-                urbi::UImage mBinImage;
-                mBinImage.imageFormat = IMAGE_GREY8;
-                mBinImage.width = p.first.cols;
-                mBinImage.height = p.first.rows;
-                mBinImage.size = mBinImage.width * mBinImage.height;
-                mBinImage.data = new uint8_t[mBinImage.size];
-                memcpy(mBinImage.data, p.first.data, mBinImage.size);
-                result = mBinImage;
-                return result;
-            }
-            index++;
-        }
-    }
-    throw std::runtime_error("[UEigenfaces]::find() : Invalid image number");
-    return result;
+    boost::mutex::scoped_lock facesLock(facesMutex);
+    int id = faces.find(name);
+    if (id < 0 || number < 0 || number >= (int) faces.imagesOf(id).size())
+        throw std::runtime_error("[UEigenfaces]::getFaceImage() : Invalid image number");
+    const cv::Mat& image = faces.image(faces.imagesOf(id)[number]);
+    urbi::UImage mBinImage;
+    mBinImage.imageFormat = IMAGE_GREY8;
+    mBinImage.width = image.cols;
+    mBinImage.height = image.rows;
+    mBinImage.size = mBinImage.width * mBinImage.height;
+    mBinImage.data = new uint8_t[mBinImage.size];
+    memcpy(mBinImage.data, image.data, mBinImage.size);
+    return mBinImage;
 }
 
 int UEigenfaces::getImageWidth() {
@@ -244,5 +882,269 @@ void UEigenfaces::setThreshold(double t) {
     thresh = t;
 }
 
+double UEigenfaces::getFaceSpaceThreshold() {
+    return faceSpaceThresh;
+}
+
+void UEigenfaces::setFaceSpaceThreshold(double t) {
+    faceSpaceThresh = t;
+}
+
+void UEigenfaces::setIndex(int lists) {
+    boost::mutex::scoped_lock modelLock(modelMutex);
+    indexLists = lists;
+    EigenfacesPtr current = model();
+    if (current) {
+        EigenfacesPtr updated = holdModel(new Eigenfaces(*current), database);
+        updated->setIndex(lists);
+        publishModel(updated);
+    }
+}
+
+void UEigenfaces::setIndexProbes(int probes) {
+    boost::mutex::scoped_lock modelLock(modelMutex);
+    indexProbes = probes;
+    EigenfacesPtr current = model();
+    if (current) {
+        EigenfacesPtr updated = holdModel(new Eigenfaces(*current), database);
+        updated->setProbes(probes);
+        publishModel(updated);
+    }
+}
+
+void UEigenfaces::setShards(int shards) {
+    boost::mutex::scoped_lock modelLock(modelMutex);
+    searchShards = shards;
+    EigenfacesPtr current = model();
+    if (current) {
+        EigenfacesPtr updated = holdModel(new Eigenfaces(*current), database);
+        updated->setShards(shards);
+        publishModel(updated);
+    }
+}
+
+void UEigenfaces::setCascade(int components) {
+    boost::mutex::scoped_lock modelLock(modelMutex);
+    cascadeComponents = components;
+    EigenfacesPtr current = model();
+    if (current) {
+        EigenfacesPtr updated = holdModel(new Eigenfaces(*current), database);
+        updated->setCascade(components);
+        publishModel(updated);
+    }
+}
+
+void UEigenfaces::setIncremental(bool enable) {
+    incremental = enable;
+}
+
+void UEigenfaces::setDriftBound(double bound) {
+    driftBound = bound;
+}
+
+void UEigenfaces::setSolver(int solver) {
+    if (solver < Eigenfaces::SOLVER_AUTO || solver > Eigenfaces::SOLVER_STREAMING)
+        throw std::runtime_error("[UEigenfaces]::setSolver() : Invalid solver");
+    pcaSolver = solver;
+}
+
+void UEigenfaces::setFindThreads(int threads) {
+    if (threads < 1)
+        throw std::runtime_error("[UEigenfaces]::setFindThreads() : Invalid number of threads");
+    boost::mutex::scoped_lock findLock(findMutex);
+    findThreads = threads;
+    findSlotFreed.notify_all();
+}
+
+double UEigenfaces::setQuantization(int type, int candidates) {
+    if (type < QuantizedGallery::NONE || type > QuantizedGallery::FP16)
+        throw std::runtime_error("[UEigenfaces]::setQuantization() : Invalid type");
+    if (candidates < 1)
+        throw std::runtime_error("[UEigenfaces]::setQuantization() : Invalid number of candidates");
+    boost::mutex::scoped_lock modelLock(modelMutex);
+    quantization = type;
+    rerankCandidates = candidates;
+    EigenfacesPtr current = model();
+    if (!current)
+        return 1.0;
+    EigenfacesPtr updated = holdModel(new Eigenfaces(*current), database);
+    updated->setQuantization(static_cast<QuantizedGallery::Type> (type), candidates);
+    double distanceError;
+    double agreement = updated->quantization_agreement(QUANTIZATION_SAMPLES, distanceError);
+    cerr << "[UEigenfaces]::setQuantization() : labels agree = " << agreement
+            << " distance error = " << distanceError
+            << " codes = " << updated->quantized_bytes() << " bytes" << endl;
+    publishModel(updated);
+    return agreement;
+}
+
+int UEigenfaces::setPrototypes(int perLabel, int method, double margin) {
+    if (method < PrototypeIndex::KMEANS || method > PrototypeIndex::MEDOIDS)
+        throw std::runtime_error("[UEigenfaces]::setPrototypes() : Invalid method");
+    boost::mutex::scoped_lock modelLock(modelMutex);
+    prototypesPerLabel = std::max(0, perLabel);
+    prototypeMethod = method;
+    prototypeMargin = margin;
+    EigenfacesPtr current = model();
+    if (!current)
+        return 0;
+    EigenfacesPtr updated = holdModel(new Eigenfaces(*current), database);
+    updated->setPrototypes(prototypesPerLabel, static_cast<PrototypeIndex::Method> (method), margin);
+    cerr << "[UEigenfaces]::setPrototypes() : " << updated->prototypes() << " prototypes for "
+            << updated->num_samples() << " images" << endl;
+    publishModel(updated);
+    return updated->prototypes();
+}
+
+int UEigenfaces::getFindAllocations() const {
+    boost::mutex::scoped_lock findLock(findMutex);
+    return findAllocations;
+}
+
+std::string UEigenfaces::getStats() const {
+    return stats.report();
+}
+
+void UEigenfaces::resetStats() {
+    stats.reset();
+}
+
+void UEigenfaces::setStatsDump(const std::string& fileName, double period) {
+    statsFile = period > 0 ? fileName : "";
+    statsPeriod = period;
+    lastStatsDump = cv::getTickCount();
+    scheduleUpdate();
+}
+
+void UEigenfaces::scheduleUpdate() {
+    // update() is called every period milliseconds, a negative period stops it
+    double period = statsFile.empty() ? -1 : statsPeriod * 1000;
+    if (asyncRunning && (period < 0 || period > ASYNC_POLL_PERIOD))
+        period = ASYNC_POLL_PERIOD;
+    USetUpdate(period);
+}
+
+int UEigenfaces::update() {
+    publishAsyncResults();
+    if (statsFile.empty() || secondsSince(lastStatsDump) < statsPeriod)
+        return 0;
+    lastStatsDump = cv::getTickCount();
+    ofstream ofs(statsFile.c_str(), ios::app);
+    time_t now = time(NULL);
+    char stamp[32];
+    strftime(stamp, sizeof (stamp), "%Y-%m-%d %H:%M:%S", localtime(&now));
+    ofs << stamp << "\n" << stats.report() << endl;
+    if (!ofs)
+        cerr << "[UEigenfaces]::update() : Cannot write " << statsFile << endl;
+    return 0;
+}
+
+bool UEigenfaces::findAsync(urbi::UImage src, int requestId) {
+    // stopped on purpose, not restarted behind the back of setAsync
+    if (asyncDisabled) {
+        stats.drop();
+        return false;
+    }
+    if (!asyncRunning)
+        setAsync(findThreads, DEFAULT_ASYNC_QUEUE);
+    // the image buffer belongs to Urbi, the worker gets a copy
+    AsyncRequest* request = new AsyncRequest;
+    request->id = requestId;
+    request->pixels.assign(src.data, src.data + src.size);
+    request->image = src;
+    request->image.data = request->pixels.empty() ? NULL : &request->pixels[0];
+    request->enqueued = cv::getTickCount();
+    // a full queue drops its oldest frames, recent frames matter more
+    bool dropped = false;
+    while (!asyncRequests->bounded_push(request)) {
+        AsyncRequest* oldest;
+        if (asyncRequests->pop(oldest)) {
+            delete oldest;
+            stats.drop();
+            dropped = true;
+        }
+    }
+    // taking the lock orders the push before the wait of an idle worker
+    {
+        boost::mutex::scoped_lock asyncLock(asyncMutex);
+    }
+    asyncReady.notify_one();
+    return !dropped;
+}
+
+void UEigenfaces::setAsync(int workers, int queueSize) {
+    if (workers < 0 || queueSize < 1)
+        throw std::runtime_error("[UEigenfaces]::setAsync() : Invalid parameters");
+    stopAsync();
+    asyncDisabled = workers == 0;
+    if (workers > 0) {
+        asyncRequests.reset(new AsyncRequestQueue(queueSize));
+        asyncStop = false;
+        for (int i = 0; i < workers; i++)
+            asyncWorkers.create_thread(boost::bind(&UEigenfaces::asyncWorker, this));
+        asyncRunning = true;
+    }
+    scheduleUpdate();
+}
+
+void UEigenfaces::stopAsync() {
+    if (!asyncRunning)
+        return;
+    {
+        boost::mutex::scoped_lock asyncLock(asyncMutex);
+        asyncStop = true;
+    }
+    asyncReady.notify_all();
+    asyncWorkers.join_all();
+    asyncRunning = false;
+    AsyncRequest* request;
+    while (asyncRequests->pop(request))
+        delete request;
+}
+
+void UEigenfaces::asyncWorker() {
+    for (;;) {
+        AsyncRequest* request;
+        if (!asyncRequests->pop(request)) {
+            // findAsync notifies under the lock after pushing, so a request
+            // pushed after the pop below is never missed
+            boost::mutex::scoped_lock asyncLock(asyncMutex);
+            if (asyncStop)
+                return;
+            if (!asyncRequests->pop(request)) {
+                asyncReady.wait(asyncLock);
+                continue;
+            }
+        }
+        AsyncResult* result = new AsyncResult;
+        result->id = request->id;
+        try {
+            result->label = findFace(request->image, result->dist);
+        } catch (const std::exception& e) {
+            cerr << "[UEigenfaces]::asyncWorker() : " << e.what() << endl;
+            result->label = "";
+            result->dist = -1;
+        }
+        result->latency = secondsSince(request->enqueued);
+        delete request;
+        asyncResults.push(result);
+    }
+}
+
+void UEigenfaces::publishAsyncResults() {
+    // UVar and UEvent may only be touched from the Urbi thread
+    AsyncResult* result;
+    while (asyncResults.pop(result)) {
+        urbi::UList entry;
+        entry.push_back(result->id);
+        entry.push_back(result->label);
+        entry.push_back(result->dist);
+        entry.push_back(result->latency);
+        lastResult = entry;
+        found.emit(result->id, result->label, result->dist, result->latency);
+        delete result;
+    }
+}
+
 
 UStart(UEigenfaces);
@@ -25,6 +25,8 @@
 #define	UEIGENFACES_H
 
 #include <urbi/uobject.hh>
+#include <deque>
+#include <map>
 #include <string>
 #include <vector>
 
@@ -34,49 +36,25 @@
 #include <cv.h>
 #endif
 
-#include <boost/archive/xml_iarchive.hpp>
-#include <boost/archive/xml_oarchive.hpp>
-#include <boost/serialization/vector.hpp>
-#include <boost/serialization/map.hpp>
-#include <boost/serialization/binary_object.hpp>
+#include <boost/atomic.hpp>
+#include <boost/lockfree/queue.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/tss.hpp>
 
+#include "databasearchive.hpp"
 #include "eigenfaces.hpp"
-
-typedef std::pair<cv::Mat, std::string> FacePair;
-
-namespace boost {
-    namespace serialization {
-
-        template<class Archive>
-        void serialize(Archive & ar, cv::Mat & g, const unsigned int version) {
-            using boost::serialization::make_nvp;
-            using boost::serialization::make_binary_object;
-            ar & make_nvp("cols", g.cols);
-            ar & make_nvp("rows", g.rows);
-            ar & make_nvp("flags", g.flags);
-            if (Archive::is_loading::value) {
-                if (g.data)
-                    delete [] g.data;
-                g.data = new uchar[g.cols * g.rows];
-            }
-            ar & make_nvp("data", make_binary_object(g.data, g.cols * g.rows));
-        }
-    } // namespace serialization
-} // namespace boost
+#include "facedatabase.hpp"
+#include "facejournal.hpp"
+#include "helper.hpp"
+#include "preprocessor.hpp"
+#include "stats.hpp"
 
 class UEigenfaces : public urbi::UObject {
-    friend class boost::serialization::access;
-
-    template<class Archive>
-    void serialize(Archive& ar, const unsigned int /* version */) {
-        using boost::serialization::make_nvp;
-        ar & make_nvp("faceWidth", faceWidth);
-        ar & make_nvp("faceHeight", faceHeight);
-        ar & make_nvp("numComponents", numComponents);
-        ar & make_nvp("threshold", thresh);
-        ar & make_nvp("faces", faces);
-    }
-
 public:
     UEigenfaces(const std::string& name);
     virtual ~UEigenfaces();
@@ -90,16 +68,76 @@ public:
 
     bool loadData(const std::string& fileName);
 
-    bool saveData(const std::string& fileName) const;
+    bool saveData(const std::string& fileName);
+
+    bool convertData(const std::string& srcFileName, const std::string& dstFileName);
+
+    /**
+     * Enrollment journal
+     * With enable every trained face is appended to fileName.journal next
+     * to the database last loaded or saved, so it survives a restart
+     * without saving the whole database. loadData replays the journal and
+     * saveData empties it. Once it holds compactAfter faces it is folded
+     * into the database in the background, 0 never compacts. Enabling it
+     * replays an existing journal of the current database.
+     */
+    void setJournal(bool enable, int compactAfter);
+
+    //! folds the journal into the database in the background, false if already running
+    bool compactJournal();
 
     // Train
     bool train(urbi::UImage src, const std::string& name);
 
+    /**
+     * Bulk training
+     * trainFromDirectory reads every image of the subdirectories of path,
+     * labelled with the name of their subdirectory (e.g. s1/1.pgm).
+     * trainFromCsv reads the images listed as "file;label" lines, file
+     * relative to the list. The images are decoded on all cores and added
+     * at once, update runs updateDatabase with the last number of
+     * components afterwards. Returns the number of images added.
+     */
+    int trainFromDirectory(const std::string& path, bool update);
+    int trainFromCsv(const std::string& fileName, bool update);
+
     bool updateDatabase(int components);
 
     // Find
     std::string find(urbi::UImage src) const;
 
+    /**
+     * Recognizes all images in a single pass over the database
+     * Returns a list of [label, distance] pairs in the order of src, label
+     * is empty if the distance exceeds the threshold.
+     */
+    urbi::UList findBatch(std::vector<urbi::UImage> src) const;
+
+    /**
+     * Returns the count nearest database images as [label, distance] pairs
+     * Nearest first, the label is empty if the distance exceeds the
+     * threshold. With perLabel only the nearest image of each label is
+     * returned, which suits voting over several frames.
+     */
+    urbi::UList findTopK(urbi::UImage src, int count, bool perLabel) const;
+
+    /**
+     * Recognizes a face of a video track
+     * track identifies the person across frames, e.g. the id of a face
+     * tracker. The gallery is not searched again while the projection of
+     * the track stays within the tracking radius of the last searched one.
+     * Returns the label most frequent among the last frames of the track.
+     */
+    std::string findTracked(urbi::UImage src, int track) const;
+
+    /**
+     * Tracking parameters
+     * radius is relative to the threshold, window is the number of frames
+     * voting for the label and tracks not seen for timeout seconds are
+     * forgotten. radius 0 searches every frame.
+     */
+    void setTracking(double radius, int window, double timeout);
+
     int getFacesCount() const;
 
     std::vector<std::string> getFacesNames();
@@ -116,16 +154,292 @@ public:
     double getThreshold();
     void setThreshold(double t);
 
+    /**
+     * Rejection of non-faces
+     * Images further than t from the face space (the span of the
+     * eigenfaces) are rejected before the database is searched, which
+     * saves the search for false detections. 0 disables it (default).
+     */
+    double getFaceSpaceThreshold();
+    void setFaceSpaceThreshold(double t);
+
+    /**
+     * Approximate search
+     * setIndex(lists) clusters the database into lists groups (about the
+     * square root of the number of images works well), 0 disables the index
+     * and searches all images. setIndexProbes(probes) sets how many groups
+     * are searched, more probes give better recall but slower find.
+     */
+    void setIndex(int lists);
+    void setIndexProbes(int probes);
+
+    /**
+     * Parallel search
+     * find searches the database split into shards at once, on all
+     * cores. Only databases of thousands of images are split, 1 searches
+     * on the calling thread (default).
+     */
+    void setShards(int shards);
+
+    /**
+     * Cascade search
+     * find bounds the distance to every image by its first components
+     * and computes the full distance only for images that could still be
+     * the nearest, the results do not change. 0 - off (default).
+     */
+    void setCascade(int components);
+
+    /**
+     * Incremental training
+     * When enabled train() adds the image to the current model right away
+     * instead of waiting for updateDatabase(). The model is recomputed from
+     * all images once the variance lost by the updates, relative to the
+     * variance kept, exceeds the drift bound.
+     */
+    void setIncremental(bool enable);
+    void setDriftBound(double bound);
+
+    /**
+     * PCA solver used by updateDatabase
+     * 0 - chosen from the size of the database (default), 1 - OpenCV PCA,
+     * 2 - Gram matrix of the images, 3 - randomized truncated SVD,
+     * 4 - streaming sketch, for databases that do not fit in memory as floats
+     */
+    void setSolver(int solver);
+
+    /**
+     * Compressed search
+     * setQuantization(type, candidates) scans the projections stored as
+     * 1 - int8 or 2 - half precision floats first, and re-ranks the
+     * candidates nearest ones exactly; 0 searches the floats (default).
+     * Returns the fraction of nearest neighbours that keep their label,
+     * measured leaving out a sample of the trained images.
+     */
+    double setQuantization(int type, int candidates);
+
+    /**
+     * Prototype search
+     * setPrototypes(perLabel, method, margin) reduces the images of every
+     * label to at most perLabel prototypes searched instead of all images,
+     * 0 disables them (default). method 0 uses the k-means centres, 1 the
+     * images nearest to them. When another label is less than margin
+     * (e.g. 0.1 for 10%) further away than the best one all images are
+     * searched. Returns the number of prototypes.
+     */
+    int setPrototypes(int perLabel, int method, double margin);
+
+    /**
+     * Concurrent recognition
+     * find() and findBatch() run in Urbi worker threads without locking the
+     * object. setFindThreads(threads) limits how many of them recognize at
+     * the same time, further calls wait for a free slot. The default is the
+     * number of cores.
+     */
+    void setFindThreads(int threads);
+
+    /**
+     * Returns how often find() had to allocate its buffers
+     * find() preprocesses the image in a single pass into buffers kept per
+     * thread, the count stops growing once every thread has seen an image
+     * of each size.
+     */
+    int getFindAllocations() const;
+
+    /**
+     * Statistics of the recognition path
+     * getStats() returns the number of calls and rejections, the model
+     * version and the latency percentiles of every stage of find().
+     * resetStats() clears them. setStatsDump(fileName, period) appends the
+     * statistics to fileName every period seconds, 0 stops it.
+     */
+    std::string getStats() const;
+    void resetStats();
+    void setStatsDump(const std::string& fileName, double period);
+
+    /**
+     * Asynchronous recognition
+     * findAsync(image, id) queues the image and returns at once, worker
+     * threads recognize it and the result [id, label, distance, latency]
+     * is stored in lastResult and emitted with the found event. latency is
+     * the time in seconds from the call to the result. When the queue is
+     * full the oldest image is dropped and false is returned. setAsync
+     * sets the number of workers and the queue size, the first findAsync
+     * starts one worker per core and a queue of 64. With 0 workers
+     * findAsync rejects the images and returns false until setAsync
+     * starts them again.
+     */
+    bool findAsync(urbi::UImage src, int requestId);
+    void setAsync(int workers, int queueSize);
+    urbi::UVar lastResult;
+    urbi::UEvent found;
+
+    /**
+     * Periodic tasks
+     * Called by Urbi as set by USetUpdate, publishes the findAsync results
+     * and dumps the statistics.
+     */
+    virtual int update();
+
 private:
+    // request of findAsync(), the image points into pixels
+    struct AsyncRequest {
+        int id;
+        std::vector<unsigned char> pixels;
+        urbi::UImage image;
+        int64 enqueued;
+    };
+
+    struct AsyncResult {
+        int id;
+        std::string label;
+        double dist;
+        double latency;
+    };
+
+    typedef boost::lockfree::queue<AsyncRequest*> AsyncRequestQueue;
+
+    // recognition state of one video track
+    struct TrackState {
+        // model the projection was searched in, expired models do not match
+        boost::weak_ptr<Eigenfaces> model;
+        // projection of the last searched frame and its result
+        cv::Mat projection;
+        std::string label;
+        double dist;
+        // results of the last frames, oldest first
+        std::deque<std::string> votes;
+        int64 lastSeen;
+    };
+
+    // buffers of one thread calling find(), allocated on its first call
+    struct FindScratch {
+        FacePreprocessor preprocessor;
+        Eigenfaces::Workspace workspace;
+
+        unsigned allocations() const {
+            return preprocessor.allocations() + workspace.allocations;
+        }
+    };
+
+    // holds one of the findThreads slots while it is in scope
+    class FindSlot {
+    public:
+        FindSlot(const UEigenfaces& owner);
+        ~FindSlot();
+    private:
+        const UEigenfaces& owner;
+    };
+
+    // decodes the files in parallel and adds them in one batch, returns the number added
+    int trainFiles(const std::vector<std::string>& files, const std::vector<std::string>& labels,
+            bool update);
+    // find() returning the distance as well
+    std::string findFace(const urbi::UImage& src, double& dist) const;
+    void stopAsync();
+    void asyncWorker();
+    void publishAsyncResults();
+    void scheduleUpdate();
+    // returns false, and counts it, if the image projected in ws is too far
+    // from the face space of model to be a face
+    bool isFace(const Eigenfaces& model, const Eigenfaces::Workspace& ws) const;
+    /**
+     * Model access
+     * The model is never modified once published: find() takes the current
+     * one with atomic_load and keeps using it, writers build a new model or a
+     * modified copy and publish it with atomic_store. Writers are serialized
+     * by modelMutex.
+     */
+    EigenfacesPtr model() const;
+    void publishModel(EigenfacesPtr model);
+    EigenfacesPtr holdModel(Eigenfaces* model, boost::shared_ptr<FaceDatabase> db) const;
+    EigenfacesPtr computeModel(const FaceStore& snapshot) const;
+    void configureModel(Eigenfaces& model) const;
+    // adds the faces the model has no samples of yet, the model holds the
+    // first faces in order; the caller holds modelMutex and facesMutex
+    void foldFaces(Eigenfaces& model) const;
+    cv::Mat prepareFace(const urbi::UImage& src) const;
+    // writes snapshot and the current model to fileName
+    void writeSnapshot(const std::string& fileName, const FaceStore& snapshot) const;
+    // replays and opens the journal of snapshotFile, the caller holds facesMutex
+    void openJournal();
+    // background part of compactJournal()
+    void compact();
+    void centerFace(const urbi::UImage& src, const Eigenfaces& model, FindScratch& scratch) const;
+    FindScratch& findScratch() const;
+
     int faceWidth;
     int faceHeight;
-    std::vector<FacePair> faces;
-    Eigenfaces* eigenfaces;
-    double distMean;
-    int numComponents;
-
-    double thresh;
+    // faces and database are guarded by facesMutex
+    FaceStore faces;
+    // mapped binary database, faces and model may point into it
+    boost::shared_ptr<FaceDatabase> database;
+    // incremented by loadData, updates of older faces are not published
+    unsigned facesGeneration;
+    // database last loaded or saved and its journal, guarded by facesMutex
+    std::string snapshotFile;
+    size_t snapshotFaces;
+    boost::shared_ptr<FaceJournal> journal;
+    bool journaling;
+    int journalCompactAfter;
+    // held while a database is written by saveData or the compaction
+    boost::mutex snapshotMutex;
+    boost::atomic<bool> compacting;
+    boost::thread compactor;
+    // current model, only accessed with boost::atomic_load/atomic_store
+    EigenfacesPtr eigenfaces;
+    mutable boost::mutex facesMutex;
+    boost::mutex modelMutex;
+    // read by the find threads while updateDatabase, loadData or the
+    // setters change them
+    boost::atomic<double> distMean;
+    boost::atomic<int> numComponents;
+    boost::atomic<double> thresh;
+    int indexLists;
+    int indexProbes;
+    int searchShards;
+    int cascadeComponents;
+    bool incremental;
+    double driftBound;
+    int pcaSolver;
+    int quantization;
+    int prototypesPerLabel;
+    int prototypeMethod;
+    double prototypeMargin;
+    int rerankCandidates;
+    mutable boost::thread_specific_ptr<FindScratch> scratch;
+    // number of find() calls allowed at once, guarded by findMutex
+    int findThreads;
+    mutable int activeFinds;
+    mutable unsigned findAllocations;
+    mutable boost::mutex findMutex;
+    mutable boost::condition_variable findSlotFreed;
+    // distance from the face space above which images are not faces, 0 - off
+    boost::atomic<double> faceSpaceThresh;
+    // video tracks of findTracked(), guarded by trackMutex
+    mutable std::map<int, TrackState> tracks;
+    mutable boost::mutex trackMutex;
+    double trackRadius;
+    int trackWindow;
+    double trackTimeout;
+    // recorded into from the find() threads without locking
+    mutable RecognitionStats stats;
+    std::string statsFile;
+    double statsPeriod;
+    int64 lastStatsDump;
+    // findAsync() requests, bounded by the capacity of the queue; results
+    // wait in asyncResults until update() publishes them
+    boost::scoped_ptr<AsyncRequestQueue> asyncRequests;
+    boost::lockfree::queue<AsyncResult*> asyncResults;
+    boost::thread_group asyncWorkers;
+    bool asyncRunning;
+    // setAsync stopped the workers, findAsync rejects the images until it starts them
+    bool asyncDisabled;
+    // idle workers wait for asyncReady, guarded by asyncMutex
+    bool asyncStop;
+    boost::mutex asyncMutex;
+    boost::condition_variable asyncReady;
 };
 
+
 #endif	/* UEIGENFACES_H */
 
@@ -0,0 +1,69 @@
+/*
+ * Face recognition based on Eigenfaces for Urbi
+ * Copyright (C) 2012  Lukasz Malek
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * File:   databasearchive.cpp
+ */
+
+#include "databasearchive.hpp"
+#include <fstream>
+#include <stdexcept>
+
+using namespace std;
+
+namespace {
+
+    bool isXmlFile(const std::string& fileName) {
+        return fileName.size() >= 4 && fileName.compare(fileName.size() - 4, 4, ".xml") == 0;
+    }
+
+} // namespace
+
+void DatabaseArchive::read(const std::string& fileName) {
+    if (FaceDatabase::isDatabase(fileName)) {
+        // faces and model point into the mapping, nothing is copied
+        database.reset(new FaceDatabase(fileName));
+        faceWidth = database->faceWidth();
+        faceHeight = database->faceHeight();
+        numComponents = database->numComponents();
+        threshold = database->threshold();
+        faces = database->faces();
+        // faces trained after the last updateDatabase make the model stale
+        model.reset();
+        if (database->trainedFaces() == (int) faces.size()) {
+            Eigenfaces* stored = database->model();
+            if (stored)
+                model = EigenfacesPtr(stored, DatabaseHolder(database));
+        }
+        return;
+    }
+    ifstream ifs(fileName.c_str());
+    if (!ifs)
+        throw std::runtime_error("[DatabaseArchive]::read() : Cannot open " + fileName);
+    boost::archive::xml_iarchive ia(ifs);
+    database.reset();
+    ia >> boost::serialization::make_nvp("UEigenfaces", *this);
+}
+
+void DatabaseArchive::write(const std::string& fileName) const {
+    if (!isXmlFile(fileName)) {
+        FaceDatabase::write(fileName, faceWidth, faceHeight, numComponents, threshold, faces, model.get());
+        return;
+    }
+    ofstream ofs(fileName.c_str());
+    boost::archive::xml_oarchive oa(ofs);
+    oa << boost::serialization::make_nvp("UEigenfaces", *this);
+}
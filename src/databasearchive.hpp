@@ -0,0 +1,191 @@
+/*
+ * Face recognition based on Eigenfaces for Urbi
+ * Copyright (C) 2012  Lukasz Malek
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * File:   databasearchive.hpp
+ */
+
+
+#ifndef DATABASEARCHIVE_HPP
+#define	DATABASEARCHIVE_HPP
+
+#include <string>
+#include <vector>
+
+#include <boost/archive/xml_iarchive.hpp>
+#include <boost/archive/xml_oarchive.hpp>
+#include <boost/serialization/vector.hpp>
+#include <boost/serialization/map.hpp>
+#include <boost/serialization/string.hpp>
+#include <boost/serialization/utility.hpp>
+#include <boost/serialization/binary_object.hpp>
+#include <boost/serialization/split_free.hpp>
+#include <boost/serialization/split_member.hpp>
+#include <boost/serialization/version.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "opencv2/opencv.hpp"
+
+#include "eigenfaces.hpp"
+#include "facedatabase.hpp"
+#include "facestore.hpp"
+#include "helper.hpp"
+
+namespace boost {
+    namespace serialization {
+
+        template<class Archive>
+        void save(Archive & ar, const cv::Mat & g, const unsigned int version) {
+            using boost::serialization::make_nvp;
+            using boost::serialization::make_binary_object;
+            cv::Mat m = g.isContinuous() ? g : g.clone();
+            ar & make_nvp("cols", m.cols);
+            ar & make_nvp("rows", m.rows);
+            ar & make_nvp("flags", m.flags);
+            ar & make_nvp("data", make_binary_object(m.data, m.total() * m.elemSize()));
+        }
+
+        template<class Archive>
+        void load(Archive & ar, cv::Mat & g, const unsigned int version) {
+            using boost::serialization::make_nvp;
+            using boost::serialization::make_binary_object;
+            int cols, rows, flags;
+            ar & make_nvp("cols", cols);
+            ar & make_nvp("rows", rows);
+            ar & make_nvp("flags", flags);
+            // only the element type is taken from the flags, the rest is
+            // recomputed by create()
+            g.create(rows, cols, flags & cv::Mat::TYPE_MASK);
+            ar & make_nvp("data", make_binary_object(g.data, g.total() * g.elemSize()));
+        }
+    } // namespace serialization
+} // namespace boost
+
+BOOST_SERIALIZATION_SPLIT_FREE(cv::Mat)
+
+typedef boost::shared_ptr<Eigenfaces> EigenfacesPtr;
+
+// deleter that keeps a mapped database alive while a model may point into it
+struct DatabaseHolder {
+    boost::shared_ptr<FaceDatabase> database;
+
+    DatabaseHolder(boost::shared_ptr<FaceDatabase> db) : database(db) {
+    }
+
+    void operator()(Eigenfaces* model) const {
+        delete model;
+    }
+};
+
+/**
+ * Contents of a database file
+ * The sizes of the faces, the settings, the faces and the trained model.
+ * loadData and saveData move them into and out of the module, convertData
+ * goes from file to file without touching the module.
+ */
+struct DatabaseArchive {
+    int faceWidth;
+    int faceHeight;
+    int numComponents;
+    double threshold;
+    FaceStore faces;
+    // trained model, empty if there is none or faces were trained after it
+    EigenfacesPtr model;
+    // mapped binary database, faces and model may point into it
+    boost::shared_ptr<FaceDatabase> database;
+
+    DatabaseArchive() : faceWidth(0), faceHeight(0), numComponents(0), threshold(0) {
+    }
+
+    //! reads a binary database, or an XML archive if the name ends with .xml
+    void read(const std::string& fileName);
+    //! writes a binary database, or an XML archive if the name ends with .xml
+    void write(const std::string& fileName) const;
+
+private:
+    friend class boost::serialization::access;
+
+    template<class Archive>
+    void save(Archive& ar, const unsigned int /* version */) const {
+        using boost::serialization::make_nvp;
+        ar & make_nvp("faceWidth", faceWidth);
+        ar & make_nvp("faceHeight", faceHeight);
+        ar & make_nvp("numComponents", numComponents);
+        ar & make_nvp("threshold", threshold);
+        std::vector<FacePair> pairs = faces.pairs();
+        ar & make_nvp("faces", pairs);
+        // version 1: trained model, stored with the number of faces it was
+        // computed from so that loadData can tell if it is stale
+        // version 2: projections stored as a single matrix
+        int trainedFaces = model ? model->num_samples() : 0;
+        ar & make_nvp("trainedFaces", trainedFaces);
+        if (trainedFaces) {
+            cv::Mat mean = model->mean();
+            cv::Mat eigenvalues = model->eigenvalues();
+            cv::Mat eigenvectors = model->eigenvectors();
+            cv::Mat projections = model->projections();
+            std::vector<std::string> labels = model->labels();
+            ar & make_nvp("mean", mean);
+            ar & make_nvp("eigenvalues", eigenvalues);
+            ar & make_nvp("eigenvectors", eigenvectors);
+            ar & make_nvp("projections", projections);
+            ar & make_nvp("labels", labels);
+        }
+    }
+
+    template<class Archive>
+    void load(Archive& ar, const unsigned int version) {
+        using boost::serialization::make_nvp;
+        ar & make_nvp("faceWidth", faceWidth);
+        ar & make_nvp("faceHeight", faceHeight);
+        ar & make_nvp("numComponents", numComponents);
+        ar & make_nvp("threshold", threshold);
+        std::vector<FacePair> pairs;
+        ar & make_nvp("faces", pairs);
+        faces.assign(pairs);
+        model.reset();
+        int trainedFaces = 0;
+        if (version >= 1)
+            ar & make_nvp("trainedFaces", trainedFaces);
+        if (trainedFaces) {
+            cv::Mat mean, eigenvalues, eigenvectors, projections;
+            std::vector<std::string> labels;
+            ar & make_nvp("mean", mean);
+            ar & make_nvp("eigenvalues", eigenvalues);
+            ar & make_nvp("eigenvectors", eigenvectors);
+            if (version >= 2) {
+                ar & make_nvp("projections", projections);
+            } else {
+                std::vector<cv::Mat> samples;
+                ar & make_nvp("projections", samples);
+                projections = cv::asRowMatrix(samples, mean.type());
+            }
+            ar & make_nvp("labels", labels);
+            // faces trained after the last updateDatabase make the model stale
+            if (trainedFaces == (int) faces.size()
+                    && mean.total() == (size_t) (faceWidth * faceHeight)) {
+                model.reset(new Eigenfaces());
+                model->load(mean, eigenvalues, eigenvectors, projections, labels);
+            }
+        }
+    }
+    BOOST_SERIALIZATION_SPLIT_MEMBER()
+};
+
+// version 2 of the archive of the module, XML files keep the root element
+BOOST_CLASS_VERSION(DatabaseArchive, 2)
+
+#endif	/* DATABASEARCHIVE_HPP */
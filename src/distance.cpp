@@ -0,0 +1,444 @@
+/*
+ * Face recognition based on Eigenfaces for Urbi
+ * Copyright (C) 2012  Lukasz Malek
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * File:   distance.cpp
+ */
+
+#include "distance.hpp"
+#include <cstring>
+#include <limits>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define USE_SSE2
+#endif
+
+#if defined(__AVX2__)
+
+namespace {
+
+    inline float hsum(__m256 v) {
+        __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+        s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+        s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+        return _mm_cvtss_f32(s);
+    }
+
+    inline __m256 madd(__m256 a, __m256 b, __m256 c) {
+#if defined(__FMA__)
+        return _mm256_fmadd_ps(a, b, c);
+#else
+        return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+#endif
+    }
+
+    // dot32f for n known at compile time: the trip count is a constant, so the compiler
+    // may unroll small loops, and the remainder branches are resolved statically
+    template<int N>
+    inline float dotN(const float* a, const float* b) {
+        __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+        for (int i = 0; i + 16 <= N; i += 16) {
+            s0 = madd(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), s0);
+            s1 = madd(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), s1);
+        }
+        int i = N / 16 * 16;
+        if (N - i >= 8) {
+            s0 = madd(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), s0);
+            i += 8;
+        }
+        float s = hsum(_mm256_add_ps(s0, s1));
+        for (; i < N; i++)
+            s += a[i] * b[i];
+        return s;
+    }
+
+} // namespace
+
+float dot32f(const float* a, const float* b, int n) {
+    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i <= n - 16; i += 16) {
+        s0 = madd(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), s0);
+        s1 = madd(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), s1);
+    }
+    for (; i <= n - 8; i += 8)
+        s0 = madd(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), s0);
+    float s = hsum(_mm256_add_ps(s0, s1));
+    for (; i < n; i++)
+        s += a[i] * b[i];
+    return s;
+}
+
+float l2sqr32f(const float* a, const float* b, int n) {
+    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i <= n - 16; i += 16) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+        s0 = madd(d0, d0, s0);
+        s1 = madd(d1, d1, s1);
+    }
+    for (; i <= n - 8; i += 8) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        s0 = madd(d0, d0, s0);
+    }
+    float s = hsum(_mm256_add_ps(s0, s1));
+    for (; i < n; i++)
+        s += (a[i] - b[i]) * (a[i] - b[i]);
+    return s;
+}
+
+float dot8s32f(const float* q, const signed char* c, int n) {
+    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i <= n - 16; i += 16) {
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*> (c + i));
+        s0 = madd(_mm256_loadu_ps(q + i), _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(b)), s0);
+        s1 = madd(_mm256_loadu_ps(q + i + 8), _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_srli_si128(b, 8))), s1);
+    }
+    float s = hsum(_mm256_add_ps(s0, s1));
+    for (; i < n; i++)
+        s += q[i] * c[i];
+    return s;
+}
+
+#if defined(__F16C__)
+
+float dot16f32f(const float* q, const unsigned short* h, int n) {
+    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i <= n - 16; i += 16) {
+        __m256 h0 = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*> (h + i)));
+        __m256 h1 = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*> (h + i + 8)));
+        s0 = madd(_mm256_loadu_ps(q + i), h0, s0);
+        s1 = madd(_mm256_loadu_ps(q + i + 8), h1, s1);
+    }
+    float s = hsum(_mm256_add_ps(s0, s1));
+    for (; i < n; i++)
+        s += q[i] * halfToFloat(h[i]);
+    return s;
+}
+
+#define HAVE_DOT16F32F
+#endif
+
+#elif defined(USE_SSE2)
+
+namespace {
+
+    inline float hsum(__m128 s) {
+        s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+        s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+        return _mm_cvtss_f32(s);
+    }
+
+    // dot32f for n known at compile time: the trip count is a constant, so the compiler
+    // may unroll small loops, and the remainder branches are resolved statically
+    template<int N>
+    inline float dotN(const float* a, const float* b) {
+        __m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps();
+        for (int i = 0; i + 8 <= N; i += 8) {
+            s0 = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)), s0);
+            s1 = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)), s1);
+        }
+        int i = N / 8 * 8;
+        if (N - i >= 4) {
+            s0 = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)), s0);
+            i += 4;
+        }
+        float s = hsum(_mm_add_ps(s0, s1));
+        for (; i < N; i++)
+            s += a[i] * b[i];
+        return s;
+    }
+
+} // namespace
+
+float dot32f(const float* a, const float* b, int n) {
+    __m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps();
+    int i = 0;
+    for (; i <= n - 8; i += 8) {
+        s0 = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)), s0);
+        s1 = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)), s1);
+    }
+    float s = hsum(_mm_add_ps(s0, s1));
+    for (; i < n; i++)
+        s += a[i] * b[i];
+    return s;
+}
+
+float l2sqr32f(const float* a, const float* b, int n) {
+    __m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps();
+    int i = 0;
+    for (; i <= n - 8; i += 8) {
+        __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+        s0 = _mm_add_ps(_mm_mul_ps(d0, d0), s0);
+        s1 = _mm_add_ps(_mm_mul_ps(d1, d1), s1);
+    }
+    float s = hsum(_mm_add_ps(s0, s1));
+    for (; i < n; i++)
+        s += (a[i] - b[i]) * (a[i] - b[i]);
+    return s;
+}
+
+float dot8s32f(const float* q, const signed char* c, int n) {
+    __m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps();
+    int i = 0;
+    for (; i <= n - 8; i += 8) {
+        // sign extend by unpacking each byte into the high half and shifting back
+        __m128i b = _mm_loadl_epi64(reinterpret_cast<const __m128i*> (c + i));
+        __m128i w = _mm_srai_epi16(_mm_unpacklo_epi8(b, b), 8);
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(w, w), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(w, w), 16);
+        s0 = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(q + i), _mm_cvtepi32_ps(lo)), s0);
+        s1 = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(q + i + 4), _mm_cvtepi32_ps(hi)), s1);
+    }
+    float s = hsum(_mm_add_ps(s0, s1));
+    for (; i < n; i++)
+        s += q[i] * c[i];
+    return s;
+}
+
+#else
+
+namespace {
+
+    // dot32f for n known at compile time, independent sums let the compiler vectorize
+    template<int N>
+    inline float dotN(const float* a, const float* b) {
+        float s[4] = {0, 0, 0, 0};
+        for (int i = 0; i + 4 <= N; i += 4) {
+            s[0] += a[i] * b[i];
+            s[1] += a[i + 1] * b[i + 1];
+            s[2] += a[i + 2] * b[i + 2];
+            s[3] += a[i + 3] * b[i + 3];
+        }
+        for (int i = N / 4 * 4; i < N; i++)
+            s[0] += a[i] * b[i];
+        return (s[0] + s[1]) + (s[2] + s[3]);
+    }
+
+} // namespace
+
+float dot32f(const float* a, const float* b, int n) {
+    float s = 0;
+    for (int i = 0; i < n; i++)
+        s += a[i] * b[i];
+    return s;
+}
+
+float l2sqr32f(const float* a, const float* b, int n) {
+    float s = 0;
+    for (int i = 0; i < n; i++)
+        s += (a[i] - b[i]) * (a[i] - b[i]);
+    return s;
+}
+
+float dot8s32f(const float* q, const signed char* c, int n) {
+    float s = 0;
+    for (int i = 0; i < n; i++)
+        s += q[i] * c[i];
+    return s;
+}
+
+#endif
+
+#if !defined(HAVE_DOT16F32F)
+
+float dot16f32f(const float* q, const unsigned short* h, int n) {
+    float s = 0;
+    for (int i = 0; i < n; i++)
+        s += q[i] * halfToFloat(h[i]);
+    return s;
+}
+
+#endif
+
+unsigned short floatToHalf(float f) {
+    unsigned int x;
+    memcpy(&x, &f, sizeof (x));
+    unsigned int sign = (x >> 16) & 0x8000;
+    unsigned int mant = x & 0x7fffff;
+    int exp = (int) ((x >> 23) & 0xff) - 127 + 15;
+    if (((x >> 23) & 0xff) == 0xff)
+        return sign | 0x7c00 | (mant ? 0x200 : 0);
+    if (exp >= 31)
+        return sign | 0x7c00;
+    if (exp <= 0) {
+        // subnormal half, shift in the implicit bit
+        if (exp < -10)
+            return sign;
+        mant |= 0x800000;
+        int shift = 14 - exp;
+        unsigned int h = mant >> shift;
+        unsigned int rest = mant & ((1u << shift) - 1);
+        unsigned int half = 1u << (shift - 1);
+        if (rest > half || (rest == half && (h & 1)))
+            h++;
+        return sign | h;
+    }
+    // a carry out of the mantissa correctly rounds up to the next exponent
+    unsigned int h = ((unsigned int) exp << 10) | (mant >> 13);
+    unsigned int rest = mant & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (h & 1)))
+        h++;
+    return sign | h;
+}
+
+float halfToFloat(unsigned short h) {
+    unsigned int sign = (unsigned int) (h & 0x8000) << 16;
+    int exp = (h >> 10) & 0x1f;
+    unsigned int mant = h & 0x3ff;
+    unsigned int x;
+    if (exp == 0) {
+        if (mant == 0) {
+            x = sign;
+        } else {
+            // normalize the subnormal
+            int e = 1;
+            while (!(mant & 0x400)) {
+                mant <<= 1;
+                e--;
+            }
+            x = sign | ((unsigned int) (e + 112) << 23) | ((mant & 0x3ff) << 13);
+        }
+    } else if (exp == 31) {
+        x = sign | 0x7f800000 | (mant << 13);
+    } else {
+        x = sign | ((unsigned int) (exp + 112) << 23) | (mant << 13);
+    }
+    float f;
+    memcpy(&f, &x, sizeof (f));
+    return f;
+}
+
+int nearest32f(const float* q, const float* gallery, size_t step,
+        const float* norms, int rows, int n, float& minDist) {
+    const char* row = reinterpret_cast<const char*> (gallery);
+    // ||q||^2 is the same for every row, it is only added to the winner
+    float best = std::numeric_limits<float>::max();
+    int bestIdx = -1;
+    for (int i = 0; i < rows; i++, row += step) {
+        float d = norms[i] - 2 * dot32f(q, reinterpret_cast<const float*> (row), n);
+        if (d < best) {
+            best = d;
+            bestIdx = i;
+        }
+    }
+    if (bestIdx >= 0) {
+        best += dot32f(q, q, n);
+        // rounding can make the distance of identical vectors negative
+        minDist = best > 0 ? best : 0;
+    } else {
+        minDist = std::numeric_limits<float>::max();
+    }
+    return bestIdx;
+}
+
+void project32f(const float* x, const float* basis, size_t step, int k, int n, float* y) {
+    const char* row = reinterpret_cast<const char*> (basis);
+    for (int j = 0; j < k; j++, row += step)
+        y[j] = dot32f(x, reinterpret_cast<const float*> (row), n);
+}
+
+namespace {
+
+    template<int N>
+    float dotFixed(const float* a, const float* b, int) {
+        return dotN<N>(a, b);
+    }
+
+    template<int N>
+    int nearestN(const float* q, const float* gallery, size_t step,
+            const float* norms, int rows, int, float& minDist) {
+        const char* row = reinterpret_cast<const char*> (gallery);
+        float best = std::numeric_limits<float>::max();
+        int bestIdx = -1;
+        for (int i = 0; i < rows; i++, row += step) {
+            float d = norms[i] - 2 * dotN<N>(q, reinterpret_cast<const float*> (row));
+            if (d < best) {
+                best = d;
+                bestIdx = i;
+            }
+        }
+        if (bestIdx >= 0) {
+            best += dotN<N>(q, q);
+            minDist = best > 0 ? best : 0;
+        } else {
+            minDist = std::numeric_limits<float>::max();
+        }
+        return bestIdx;
+    }
+
+    template<int N>
+    void projectN(const float* x, const float* basis, size_t step, int k, int, float* y) {
+        const char* row = reinterpret_cast<const char*> (basis);
+        for (int j = 0; j < k; j++, row += step)
+            y[j] = dotN<N>(x, reinterpret_cast<const float*> (row));
+    }
+
+} // namespace
+
+NearestKernel nearestKernel(int n) {
+    switch (n) {
+        case 8: return nearestN<8>;
+        case 16: return nearestN<16>;
+        case 24: return nearestN<24>;
+        case 32: return nearestN<32>;
+        case 40: return nearestN<40>;
+        case 48: return nearestN<48>;
+        case 50: return nearestN<50>;
+        case 64: return nearestN<64>;
+        case 80: return nearestN<80>;
+        case 96: return nearestN<96>;
+        case 100: return nearestN<100>;
+        case 128: return nearestN<128>;
+        default: return nearest32f;
+    }
+}
+
+DotKernel dotKernel(int n) {
+    switch (n) {
+        case 8: return dotFixed<8>;
+        case 16: return dotFixed<16>;
+        case 24: return dotFixed<24>;
+        case 32: return dotFixed<32>;
+        case 40: return dotFixed<40>;
+        case 48: return dotFixed<48>;
+        case 50: return dotFixed<50>;
+        case 64: return dotFixed<64>;
+        case 80: return dotFixed<80>;
+        case 96: return dotFixed<96>;
+        case 100: return dotFixed<100>;
+        case 128: return dotFixed<128>;
+        default: return dot32f;
+    }
+}
+
+ProjectKernel projectKernel(int n) {
+    switch (n) {
+        case 48 * 48: return projectN<48 * 48>;
+        case 64 * 64: return projectN<64 * 64>;
+        case 92 * 112: return projectN<92 * 112>;
+        case 100 * 100: return projectN<100 * 100>;
+        case 128 * 128: return projectN<128 * 128>;
+        default: return NULL;
+    }
+}
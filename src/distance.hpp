@@ -0,0 +1,88 @@
+/*
+ * Face recognition based on Eigenfaces for Urbi
+ * Copyright (C) 2012  Lukasz Malek
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * File:   distance.hpp
+ */
+
+#ifndef DISTANCE_HPP_
+#define DISTANCE_HPP_
+
+#include <cstddef>
+
+/*
+ * Distance kernels for the gallery search
+ *
+ * The kernels use AVX2/FMA or SSE2 when the compiler targets them and
+ * fall back to plain loops otherwise. Pointers need no particular
+ * alignment, but rows aligned to 64 bytes load fastest.
+ */
+
+//! dot product of a and b
+float dot32f(const float* a, const float* b, int n);
+
+//! squared euclidean distance between a and b
+float l2sqr32f(const float* a, const float* b, int n);
+
+//! dot product of q and int8 codes c
+float dot8s32f(const float* q, const signed char* c, int n);
+
+//! dot product of q and half precision floats h
+float dot16f32f(const float* q, const unsigned short* h, int n);
+
+//! converts to half precision, rounding to nearest even
+unsigned short floatToHalf(float f);
+
+//! converts from half precision
+float halfToFloat(unsigned short h);
+
+/**
+ * Finds the gallery row nearest to q
+ * Uses ||q-g||^2 = ||q||^2 - 2 q.g + ||g||^2 with the precomputed squared
+ * row norms, so only one dot product is needed per row. gallery holds rows
+ * of n floats, step bytes apart. Returns the index of the nearest row, or
+ * -1 for an empty gallery, and its squared distance in minDist.
+ */
+int nearest32f(const float* q, const float* gallery, size_t step,
+		const float* norms, int rows, int n, float& minDist);
+
+//! projects x on the k rows of n floats of basis, step bytes apart, into y
+void project32f(const float* x, const float* basis, size_t step, int k, int n, float* y);
+
+/*
+ * Kernels specialized for the common sizes
+ *
+ * The sizes are template parameters, so the loop bounds are constants
+ * and the remainder checks are resolved at compile time. Whether the loops
+ * are unrolled is up to the compiler, typically only for the small
+ * component counts, not for the sample sizes of projectKernel. The n
+ * argument is ignored.
+ */
+typedef int (*NearestKernel)(const float* q, const float* gallery, size_t step,
+		const float* norms, int rows, int n, float& minDist);
+typedef float (*DotKernel)(const float* a, const float* b, int n);
+typedef void (*ProjectKernel)(const float* x, const float* basis, size_t step, int k, int n, float* y);
+
+//! returns nearest32f specialized for rows of n floats, nearest32f itself for other n
+NearestKernel nearestKernel(int n);
+
+//! returns dot32f specialized for n floats, the one nearestKernel(n) uses
+DotKernel dotKernel(int n);
+
+//! returns project32f specialized for samples of n floats, NULL for other n
+ProjectKernel projectKernel(int n);
+
+#endif /* DISTANCE_HPP_ */
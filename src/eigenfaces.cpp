@@ -1,16 +1,200 @@
 #include "helper.hpp"
 #include "eigenfaces.hpp"
+#include "distance.hpp"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <map>
 
-Eigenfaces::Eigenfaces(const Mat& src, const vector<std::string>& labels, int num_components, bool dataAsRow) {
-    _num_components = num_components;
+// number of samples projected or searched at a time
+static const int BLOCK_SIZE = 256;
+// extra dimensions and power iterations of the randomized SVD
+static const int OVERSAMPLING = 10;
+static const int POWER_ITERATIONS = 2;
+// the streaming solver is chosen for data larger than this many bytes
+static const double STREAMING_BYTES = 1024.0 * 1024 * 1024;
+// rows of the Frequent Directions sketch per component
+static const int SKETCH_FACTOR = 2;
+// rounding of the full distance allowed for by the cascade, relative to the norms
+static const float CASCADE_SLACK = 1e-4f;
+// update() rotates the projections and rebuilds the index, the codes and the
+// prototypes once the added projections exceed this fraction of them, or the
+// drift grew by this much
+static const double REBUILD_GROWTH = 0.1;
+static const double REBUILD_DRIFT = 0.01;
+// or the stored projections have this many more columns than components, relative
+static const double REBUILD_WIDTH = 0.25;
+// a shard is not worth a task with fewer projections
+static const int MIN_SHARD_ROWS = 4096;
+
+// first row of a shard of rows split into shards ranges
+static inline int shardBegin(int shard, int shards, int rows) {
+    return (int) ((long long) shard * rows / shards);
+}
+
+// keeps the count smallest entries in the max-heap nearest
+static inline void keepNearest(QuantizedGallery::Candidates& nearest, int count,
+        const std::pair<float, int>& entry) {
+    if ((int) nearest.size() < count) {
+        nearest.push_back(entry);
+        std::push_heap(nearest.begin(), nearest.end());
+    } else if (entry < nearest.front()) {
+        std::pop_heap(nearest.begin(), nearest.end());
+        nearest.back() = entry;
+        std::push_heap(nearest.begin(), nearest.end());
+    }
+}
+
+// nearest row of each shard of the projections
+class ShardSearch : public ParallelLoopBody {
+public:
+    ShardSearch(NearestKernel kernel, const float* q, const Mat& projections, const float* norms,
+            int shards, std::pair<float, int>* results) :
+        kernel(kernel), q(q), projections(projections), norms(norms), shards(shards), results(results) {}
+
+    void operator()(const Range& range) const {
+        int rows = projections.rows;
+        for (int shard = range.start; shard < range.end; shard++) {
+            int begin = shardBegin(shard, shards, rows);
+            int end = shardBegin(shard + 1, shards, rows);
+            float d;
+            int i = kernel(q, projections.ptr<float>(begin), projections.step, norms + begin,
+                    end - begin, projections.cols, d);
+            results[shard] = std::make_pair(d, i < 0 ? -1 : begin + i);
+        }
+    }
+
+private:
+    NearestKernel kernel;
+    const float* q;
+    const Mat& projections;
+    const float* norms;
+    int shards;
+    std::pair<float, int>* results;
+};
+
+// count nearest rows, or nearest row of every label, of each shard of the projections
+class ShardNearest : public ParallelLoopBody {
+public:
+    ShardNearest(const float* q, const Mat& projections, const vector<float>& norms,
+            const vector<int>& classes, int count, bool perLabel, Eigenfaces::Workspace& ws) :
+        q(q), projections(projections), norms(norms), classes(classes), count(count),
+        perLabel(perLabel), ws(ws) {}
+
+    void operator()(const Range& range) const {
+        int rows = projections.rows;
+        int k = projections.cols;
+        int shards = ws.shardNearest.size();
+        float qq = dot32f(q, q, k);
+        for (int shard = range.start; shard < range.end; shard++) {
+            QuantizedGallery::Candidates& nearest = ws.shardNearest[shard];
+            QuantizedGallery::Candidates& classBest = ws.shardClassBest[shard];
+            nearest.clear();
+            int end = shardBegin(shard + 1, shards, rows);
+            for (int i = shardBegin(shard, shards, rows); i < end; i++) {
+                float d = norms[i] - 2 * dot32f(q, projections.ptr<float>(i), k) + qq;
+                std::pair<float, int> entry(std::max(d, 0.0f), i);
+                if (!perLabel)
+                    keepNearest(nearest, count, entry);
+                else if (entry < classBest[classes[i]])
+                    classBest[classes[i]] = entry;
+            }
+        }
+    }
+
+private:
+    const float* q;
+    const Mat& projections;
+    const vector<float>& norms;
+    const vector<int>& classes;
+    int count;
+    bool perLabel;
+    Eigenfaces::Workspace& ws;
+};
+
+// (data - 1*mean) * M without forming the centered data
+static Mat centeredProduct(const Mat& data, const Mat& mean, const Mat& M) {
+    Mat Y;
+    gemm(data, M, 1.0, Mat(), 0.0, Y);
+    Mat shift = mean * M;
+    for (int i = 0; i < Y.rows; i++) {
+        Mat y = Y.row(i);
+        y -= shift;
+    }
+    return Y;
+}
+
+// (data - 1*mean)' * M without forming the centered data
+static Mat centeredTransposedProduct(const Mat& data, const Mat& mean, const Mat& M) {
+    Mat Z, sums;
+    gemm(data, M, 1.0, Mat(), 0.0, Z, GEMM_1_T);
+    reduce(M, sums, 0, CV_REDUCE_SUM);
+    Z -= mean.t() * sums;
+    return Z;
+}
+
+// orthonormal basis of the columns of Y from the eigenvectors of Y'Y
+static Mat orthonormalize(const Mat& Y) {
+    Mat Yd, evals, evecs;
+    Y.convertTo(Yd, CV_64F);
+    eigen(Mat(Yd.t() * Yd), evals, evecs);
+    int r = 0;
+    while (r < evals.rows && evals.at<double>(r) > 1e-10 * evals.at<double>(0))
+        r++;
+    Mat Q = Yd * evecs.rowRange(0, r).t();
+    for (int j = 0; j < r; j++) {
+        Mat q = Q.col(j);
+        q *= 1.0 / std::sqrt(evals.at<double>(j));
+    }
+    Q.convertTo(Q, Y.type());
+    return Q;
+}
+
+// picks a solver from the number of samples n, dimensions d and components k
+static Eigenfaces::Solver chooseSolver(int n, int d, int k) {
+    int rank = std::min(n, d);
+    if (rank > 2000 && 4 * k <= rank)
+        return Eigenfaces::SOLVER_RANDOMIZED;
+    if (n < d)
+        return Eigenfaces::SOLVER_SNAPSHOT;
+    return Eigenfaces::SOLVER_OPENCV;
+}
+
+void Eigenfaces::init(int num_components, bool dataAsRow) {
     _dataAsRow = dataAsRow;
+    _num_components = num_components;
+    _max_components = num_components;
+    _drift = 0;
+    _nlist = 0;
+    _nprobe = 8;
+    _prototypes_per_label = 0;
+    _prototype_method = PrototypeIndex::KMEANS;
+    _margin = 0;
+    _built_rows = 0;
+    _built_cols = 0;
+    _built_drift = 0;
+    _quantization = QuantizedGallery::NONE;
+    _rerank = 32;
+    _shards = 1;
+    _nearest = nearest32f;
+    _project = NULL;
+    _dot = dot32f;
+    _cascade = 0;
+    _solver = SOLVER_AUTO;
+    _solver_used = SOLVER_AUTO;
+    _chunk_rows = 1024;
+    _compute_time = 0;
+    _reconstruction_error = 0;
+}
+
+Eigenfaces::Eigenfaces(const Mat& src, const vector<std::string>& labels, int num_components, bool dataAsRow) {
+    init(num_components, dataAsRow);
     // compute the eigenfaces
     compute(src, labels);
 }
 
 Eigenfaces::Eigenfaces(const vector<Mat>& src, const vector<std::string>& labels, int num_components, bool dataAsRow) {
-    _num_components = num_components;
-    _dataAsRow = dataAsRow;
+    init(num_components, dataAsRow);
     // compute the eigenfaces
     compute(src, labels);
 }
@@ -25,59 +209,957 @@ void Eigenfaces::compute(const Mat& src, const vector<std::string>& labels) {
     // assert there are as much samples as labels
     if (n != labels.size())
         CV_Error(CV_StsBadArg, "The number of samples must equal the number of labels!");
-    // clip number of components to be valid
+    // clip number of components to be valid, update() may grow up to the requested number
+    _max_components = _num_components;
+    _drift = 0;
     if ((_num_components <= 0) || (_num_components > n))
         _num_components = n;
     // perform the PCA
-    PCA pca(data,
-            Mat(),
-            CV_PCA_DATA_AS_ROW,
-            _num_components);
+    int64 start = getTickCount();
+    // the data is in memory already, streaming it would only be slower
+    _solver_used = _solver == SOLVER_AUTO || _solver == SOLVER_STREAMING
+            ? chooseSolver(n, d, _num_components) : _solver;
+    Mat mean, eigenvalues, eigenvectors;
+    if (_solver_used == SOLVER_SNAPSHOT) {
+        computeSnapshot(data, mean, eigenvalues, eigenvectors);
+    } else if (_solver_used == SOLVER_RANDOMIZED) {
+        computeRandomized(data, mean, eigenvalues, eigenvectors);
+    } else {
+        PCA pca(data,
+                Mat(),
+                CV_PCA_DATA_AS_ROW,
+                _num_components);
+        mean = pca.mean;
+        eigenvalues = pca.eigenvalues.clone();
+        eigenvectors = transpose(pca.eigenvectors); // OpenCV stores the Eigenvectors by row (??)
+    }
+    _compute_time = (getTickCount() - start) / getTickFrequency();
     // set the data
-    _mean = _dataAsRow ? pca.mean.reshape(1, 1) : pca.mean.reshape(1, pca.mean.total()); // store the mean vector
-    _eigenvalues = pca.eigenvalues.clone(); // store the eigenvectors
-    _eigenvectors = transpose(pca.eigenvectors); // OpenCV stores the Eigenvectors by row (??)
-    _labels = vector<std::string > (labels); // store labels for projections
-    // projections
-    for (int sampleIdx = 0; sampleIdx < data.rows; sampleIdx++) {
-        this->_projections.push_back(project(_dataAsRow ? src.row(sampleIdx) : src.col(sampleIdx)));
+    _mean = _dataAsRow ? mean.reshape(1, 1) : mean.reshape(1, mean.total()); // store the mean vector
+    _eigenvalues = eigenvalues; // store the eigenvalues
+    _eigenvectors = eigenvectors; // store the eigenvectors
+    // the variance not explained is the total variance minus the eigenvalues
+    double variance = -norm(mean, NORM_L2SQR);
+    for (int sampleIdx = 0; sampleIdx < n; sampleIdx++)
+        variance += norm(data.row(sampleIdx), NORM_L2SQR) / n;
+    double explained = sum(eigenvalues)[0];
+    _reconstruction_error = variance > 0 ? std::max(0.0, 1.0 - explained / variance) : 0;
+    setLabels(labels); // store labels for projections
+    // projections, computed in blocks to bound the size of the centered copy
+    Mat projections(n, _eigenvectors.cols, CV_32F);
+    for (int sampleIdx = 0; sampleIdx < n; sampleIdx += BLOCK_SIZE) {
+        int end = std::min(n, sampleIdx + BLOCK_SIZE);
+        Mat Y = _dataAsRow ? project(src.rowRange(sampleIdx, end))
+                : transpose(project(src.colRange(sampleIdx, end)));
+        Y.convertTo(projections.rowRange(sampleIdx, end), CV_32F);
     }
+    setProjections(projections);
 }
 
 void Eigenfaces::compute(const vector<Mat>& src, const vector<std::string>& labels) {
+    // never hold all samples as floats when they do not fit in memory
+    double bytes = src.empty() ? 0 : (double) src.size() * src[0].total() * sizeof (float);
+    if (_solver == SOLVER_STREAMING || (_solver == SOLVER_AUTO && bytes > STREAMING_BYTES)) {
+        computeStreaming(src, labels);
+        return;
+    }
     compute(_dataAsRow ? asRowMatrix(src) : asColumnMatrix(src), labels);
 }
 
-std::string Eigenfaces::predict(const Mat& src, double& dist) {
-    Mat q = project(_dataAsRow ? src.reshape(1, 1) : src.reshape(1, src.total()));
+// converts the samples begin..end of src into the first rows of dst
+static void loadRows(const vector<Mat>& src, int begin, int end, Mat& dst) {
+    for (int sampleIdx = begin; sampleIdx < end; sampleIdx++) {
+        if ((int) src[sampleIdx].total() != dst.cols)
+            CV_Error(CV_StsBadArg, "All samples must have the same size!");
+        Mat sample = src[sampleIdx].isContinuous() ? src[sampleIdx] : src[sampleIdx].clone();
+        Mat row = dst.row(sampleIdx - begin);
+        sample.reshape(1, 1).convertTo(row, dst.type());
+    }
+}
+
+// shrinks the rows of a Frequent Directions sketch to at most l, returns the rows left
+static int shrinkSketch(Mat& sketch, int rows, int l) {
+    // the eigenvectors of the Gram matrix are the left singular vectors,
+    // every row becomes sqrt(lambda_i - delta) v_i' = sqrt(1 - delta / lambda_i) u_i' B
+    Mat B = sketch.rowRange(0, rows);
+    Mat G, evals, evecs;
+    gemm(B, B, 1.0, Mat(), 0.0, G, GEMM_2_T);
+    G.convertTo(G, CV_64F);
+    eigen(G, evals, evecs);
+    double delta = rows > l ? evals.at<double>(l) : 0;
+    int r = 0;
+    while (r < std::min(rows, l) && evals.at<double>(r) > delta)
+        r++;
+    Mat W(r, rows, CV_64F);
+    for (int i = 0; i < r; i++) {
+        Mat w = W.row(i);
+        evecs.row(i).copyTo(w);
+        w *= std::sqrt(1 - delta / evals.at<double>(i));
+    }
+    W.convertTo(W, B.type());
+    Mat shrunk = W * B;
+    shrunk.copyTo(sketch.rowRange(0, r));
+    return r;
+}
+
+void Eigenfaces::computeStreaming(const vector<Mat>& src, const vector<std::string>& labels) {
+    // E. Liberty, "Simple and deterministic matrix sketching", 2013. Only
+    // a chunk of samples and the sketch are held as floats at a time.
+    int n = src.size();
+    if (n == 0)
+        CV_Error(CV_StsBadArg, "No samples given!");
+    if (n != (int) labels.size())
+        CV_Error(CV_StsBadArg, "The number of samples must equal the number of labels!");
+    int d = src[0].total();
+    _max_components = _num_components;
+    _drift = 0;
+    if ((_num_components <= 0) || (_num_components > std::min(n, d)))
+        _num_components = std::min(n, d);
+    int64 start = getTickCount();
+    _solver_used = SOLVER_STREAMING;
+    int chunk = std::min(_chunk_rows, n);
+    Mat rows(chunk, d, CV_32F);
+    // first pass: the mean
+    Mat total = Mat::zeros(1, d, CV_64F), partial;
+    for (int begin = 0; begin < n; begin += chunk) {
+        int end = std::min(n, begin + chunk);
+        loadRows(src, begin, end, rows);
+        reduce(rows.rowRange(0, end - begin), partial, 0, CV_REDUCE_SUM, CV_64F);
+        total += partial;
+    }
+    Mat mean;
+    total.convertTo(mean, CV_32F, 1.0 / n);
+    // second pass: the sketch of the centered samples, the chunk is
+    // appended below the sketch and the whole is shrunk again
+    int l = std::min(SKETCH_FACTOR * _num_components, std::min(n, d));
+    Mat sketch(l + chunk, d, CV_32F);
+    int sketchRows = 0;
+    double variance = 0;
+    for (int begin = 0; begin < n; begin += chunk) {
+        int end = std::min(n, begin + chunk);
+        Mat block = sketch.rowRange(sketchRows, sketchRows + end - begin);
+        loadRows(src, begin, end, block);
+        for (int i = 0; i < block.rows; i++) {
+            Mat row = block.row(i);
+            subtract(row, mean, row);
+            variance += norm(row, NORM_L2SQR) / n;
+        }
+        sketchRows += block.rows;
+        if (sketchRows > l)
+            sketchRows = shrinkSketch(sketch, sketchRows, l);
+    }
+    // the right singular vectors of the sketch approximate the eigenvectors
+    Mat B = sketch.rowRange(0, sketchRows);
+    Mat G, evals, evecs;
+    gemm(B, B, 1.0, Mat(), 0.0, G, GEMM_2_T);
+    G.convertTo(G, CV_64F);
+    eigen(G, evals, evecs);
+    int k = 0;
+    while (k < std::min(_num_components, sketchRows) && evals.at<double>(k) > 1e-10 * evals.at<double>(0))
+        k++;
+    _num_components = k;
+    Mat U;
+    evecs.rowRange(0, k).convertTo(U, CV_32F);
+    Mat eigenvectors;
+    gemm(B, U, 1.0, Mat(), 0.0, eigenvectors, GEMM_1_T + GEMM_2_T);
+    Mat eigenvalues(k, 1, CV_32F);
+    for (int j = 0; j < k; j++) {
+        double lambda = evals.at<double>(j);
+        Mat w = eigenvectors.col(j);
+        w *= 1.0 / std::sqrt(lambda);
+        eigenvalues.at<float>(j) = (float) (lambda / n);
+    }
+    sketch.release();
+    _compute_time = (getTickCount() - start) / getTickFrequency();
+    _mean = _dataAsRow ? mean : mean.reshape(1, d);
+    _eigenvalues = eigenvalues;
+    _eigenvectors = eigenvectors;
+    double explained = sum(eigenvalues)[0];
+    _reconstruction_error = variance > 0 ? std::max(0.0, 1.0 - explained / variance) : 0;
+    setLabels(labels);
+    // third pass: the projections, written straight into the aligned gallery
+    Mat projections = allocAligned(n, k, CV_32F), Y;
+    for (int begin = 0; begin < n; begin += chunk) {
+        int end = std::min(n, begin + chunk);
+        Mat block = rows.rowRange(0, end - begin);
+        loadRows(src, begin, end, block);
+        for (int i = 0; i < block.rows; i++) {
+            Mat row = block.row(i);
+            subtract(row, mean, row);
+        }
+        gemm(block, _eigenvectors, 1.0, Mat(), 0.0, Y);
+        Y.copyTo(projections.rowRange(begin, end));
+    }
+    setProjections(projections);
+}
+
+void Eigenfaces::computeSnapshot(const Mat& data, Mat& mean, Mat& eigenvalues, Mat& eigenvectors) {
+    int n = data.rows;
+    int type = data.type();
+    reduce(data, mean, 0, CV_REDUCE_AVG);
+    // Gram matrix of the centered samples without centering them:
+    // (x_i - m)(x_j - m)' = x_i x_j' - x_i m' - m x_j' + m m'
+    Mat G, r;
+    gemm(data, data, 1.0, Mat(), 0.0, G, GEMM_2_T);
+    gemm(data, mean, 1.0, Mat(), 0.0, r, GEMM_2_T);
+    G.convertTo(G, CV_64F);
+    r.convertTo(r, CV_64F);
+    double mm = norm(mean, NORM_L2SQR);
+    for (int i = 0; i < n; i++)
+        for (int j = 0; j < n; j++)
+            G.at<double>(i, j) = (G.at<double>(i, j) - r.at<double>(i) - r.at<double>(j) + mm) / n;
+    // G and the covariance share the eigenvalues, eigenvectors are X'v / sqrt(n lambda)
+    Mat evals, evecs, V;
+    eigen(G, evals, evecs);
+    evecs.rowRange(0, _num_components).convertTo(V, type);
+    eigenvectors = centeredTransposedProduct(data, mean, V.t());
+    for (int j = 0; j < _num_components; j++) {
+        double lambda = evals.at<double>(j);
+        Mat w = eigenvectors.col(j);
+        w *= lambda > 0 ? 1.0 / std::sqrt(n * lambda) : 0.0;
+    }
+    evals.rowRange(0, _num_components).convertTo(eigenvalues, type);
+}
+
+void Eigenfaces::computeRandomized(const Mat& data, Mat& mean, Mat& eigenvalues, Mat& eigenvectors) {
+    // N. Halko, P. G. Martinsson and J. A. Tropp, "Finding structure with
+    // randomness: probabilistic algorithms for constructing approximate
+    // matrix decompositions", 2011. The centered data is never formed.
+    int n = data.rows;
+    int d = data.cols;
+    int type = data.type();
+    int l = std::min(_num_components + OVERSAMPLING, std::min(n, d));
+    reduce(data, mean, 0, CV_REDUCE_AVG);
+    // range of the centered data from a random projection and power iterations
+    Mat omega(d, l, type);
+    randn(omega, Scalar::all(0), Scalar::all(1));
+    Mat Q = orthonormalize(centeredProduct(data, mean, omega));
+    for (int it = 0; it < POWER_ITERATIONS; it++) {
+        Mat Z = orthonormalize(centeredTransposedProduct(data, mean, Q));
+        Q = orthonormalize(centeredProduct(data, mean, Z));
+    }
+    // B = Q'X is small, its right singular vectors from the eigenvectors of BB'
+    Mat B = centeredTransposedProduct(data, mean, Q).t();
+    Mat Bd, evals, evecs;
+    B.convertTo(Bd, CV_64F);
+    eigen(Mat(Bd * Bd.t()), evals, evecs);
+    int k = std::min(_num_components, evals.rows);
+    Mat U;
+    evecs.rowRange(0, k).convertTo(U, type);
+    gemm(B, U, 1.0, Mat(), 0.0, eigenvectors, GEMM_1_T | GEMM_2_T);
+    for (int j = 0; j < k; j++) {
+        double sigma2 = evals.at<double>(j);
+        Mat w = eigenvectors.col(j);
+        w *= sigma2 > 0 ? 1.0 / std::sqrt(sigma2) : 0.0;
+    }
+    // eigenvalues of the covariance are sigma^2 / n
+    evals.rowRange(0, k).convertTo(eigenvalues, type, 1.0 / n);
+    _num_components = k;
+}
+
+void Eigenfaces::load(const Mat& mean, const Mat& eigenvalues, const Mat& eigenvectors,
+        const Mat& projections, const vector<std::string>& labels) {
+    // assert the model is consistent
+    if (projections.rows != labels.size())
+        CV_Error(CV_StsBadArg, "The number of projections must equal the number of labels!");
+    if (mean.total() != (size_t) eigenvectors.rows)
+        CV_Error(CV_StsBadArg, "The mean does not match the dimensionality of the eigenvectors!");
+    if (!projections.empty() && projections.cols != eigenvectors.cols)
+        CV_Error(CV_StsBadArg, "The projections do not match the number of eigenvectors!");
+    _num_components = eigenvectors.cols;
+    _max_components = _num_components;
+    _drift = 0;
+    _mean = mean;
+    _eigenvalues = eigenvalues;
+    _eigenvectors = eigenvectors;
+    setLabels(labels);
+    setProjections(projections);
+}
+
+void Eigenfaces::update(const Mat& src, const std::string& label) {
+    if (_mean.empty())
+        CV_Error(CV_StsError, "The model must be computed before it can be updated!");
+    // Incremental eigenspace update for one sample, see P. Hall, D. Marshall
+    // and R. Martin, "Incremental Eigenanalysis for Classification", 1998.
+    // All members are replaced by new matrices, never written in place, as
+    // they may be shared with copies of this model or a mapped file; the
+    // new projection only goes to a row of the gallery no copy holds.
+    double n = _classes.size();
+    int d = _mean.total();
+    int k = _eigenvectors.cols;
+    Mat mean, W, x;
+    _mean.reshape(1, 1).convertTo(mean, CV_64F);
+    _eigenvectors.convertTo(W, CV_64F);
+    src.reshape(1, 1).convertTo(x, CV_64F);
+    if (x.cols != d)
+        CV_Error(CV_StsBadArg, "The sample does not match the dimensionality of the model!");
+    // split the centered sample into its projection g and the residual h
+    Mat a = x - mean;
+    Mat g = a * W;
+    Mat h = a - g * W.t();
+    double gamma = norm(h);
+    // grow the basis only by a direction that is not already spanned
+    bool grow = gamma > 1e-6 * norm(a);
+    int m = grow ? k + 1 : k;
+    // covariance of n+1 samples in the basis [W h/gamma]:
+    // n/(n+1) diag(eigenvalues, 0) + n/(n+1)^2 [g gamma]'[g gamma]
+    Mat c = Mat::zeros(1, m, CV_64F);
+    g.copyTo(c.colRange(0, k));
+    if (grow)
+        c.at<double>(0, k) = gamma;
+    Mat eigenvalues;
+    _eigenvalues.reshape(1, k).convertTo(eigenvalues, CV_64F);
+    Mat D = (n / ((n + 1) * (n + 1))) * (c.t() * c);
+    for (int i = 0; i < k; i++)
+        D.at<double>(i, i) += n / (n + 1) * eigenvalues.at<double>(i);
+    Mat evals, evecs;
+    eigen(D, evals, evecs);
+    // keep the leading components, eigen() returns them by row in descending order
+    int kept = (_max_components > 0) ? std::min(m, std::max(k, _max_components)) : m;
+    double keptVariance = 0, droppedVariance = 0;
+    for (int i = 0; i < m; i++)
+        (i < kept ? keptVariance : droppedVariance) += evals.at<double>(i);
+    if (droppedVariance > 0)
+        _drift += droppedVariance / std::max(keptVariance, DBL_MIN);
+    Mat R = evecs.rowRange(0, kept).t();
+    Mat basis = W;
+    if (grow)
+        hconcat(W, h.t() / gamma, basis);
+    Mat eigenvectors = basis * R;
+    Mat shift = (a * eigenvectors) / (n + 1);
+    Mat newMean = mean + a / (n + 1);
+    // the stored projections are not rotated. A current projection y is
+    // stored as z = y T + offset, T having orthonormal rows, so that
+    // y = (z - offset) T'. The projections move as y' = [y 0] R - shift,
+    // assuming they lie in the old basis, which is folded into T. A grown
+    // basis gets another stored column, zero for the stored projections,
+    // so that the new one is stored exactly.
+    int storedK = _projections.cols;
+    Mat T = _built_transform, offset = _built_offset;
+    if (T.empty()) {
+        T = Mat::eye(k, storedK, CV_64F);
+        offset = Mat::zeros(1, storedK, CV_64F);
+    }
+    int grownK = grow ? storedK + 1 : storedK;
+    Mat A = Mat::zeros(grownK, m, CV_64F);
+    Mat(T.t()).copyTo(A(Rect(0, 0, k, storedK)));
+    if (grow)
+        A.at<double>(storedK, k) = 1;
+    Mat center = Mat::zeros(1, m, CV_64F);
+    Mat(offset * T.t()).copyTo(center.colRange(0, k));
+    Mat transform = Mat(A * R).t();
+    Mat storedOffset = (center * R + shift) * transform;
+    // and the projection of the new sample
+    Mat y;
+    gemm(x - newMean, eigenvectors, 1.0, Mat(), 0.0, y);
+    Mat projection;
+    Mat(y * transform + storedOffset).convertTo(projection, CV_32F);
+    // store in the types the model was computed with, into new matrices
+    Mat storedMean, storedEigenvalues, storedEigenvectors;
+    newMean.convertTo(storedMean, _mean.type());
+    evals.rowRange(0, kept).convertTo(storedEigenvalues, _eigenvalues.type());
+    eigenvectors.convertTo(storedEigenvectors, _eigenvectors.type());
+    _mean = _dataAsRow ? storedMean : storedMean.reshape(1, d);
+    _eigenvalues = storedEigenvalues;
+    _eigenvectors = storedEigenvectors;
+    _num_components = kept;
+    _built_transform = transform;
+    _built_offset = storedOffset;
+    int labelId = std::find(_names.begin(), _names.end(), label) - _names.begin();
+    if (labelId == (int) _names.size())
+        _names.push_back(label);
+    _classes.push_back(labelId);
+    appendProjection(projection);
+    setKernels();
+    // rotating the projections and rebuilding the structures costs far
+    // more than the update. Until enough changed the queries are mapped to
+    // the stored basis, the added projections are scanned in addition and
+    // the distances grow by the components dropped since.
+    int added = _projections.rows - _built_rows;
+    if (added > REBUILD_GROWTH * _built_rows || _drift - _built_drift > REBUILD_DRIFT
+            || _projections.cols > (1 + REBUILD_WIDTH) * kept)
+        rebuild();
+}
+
+void Eigenfaces::setLabels(const vector<std::string>& labels) {
+    map<std::string, int> ids;
+    _names.clear();
+    _classes.resize(labels.size());
+    for (size_t sampleIdx = 0; sampleIdx < labels.size(); sampleIdx++) {
+        map<std::string, int>::iterator it = ids.find(labels[sampleIdx]);
+        if (it == ids.end()) {
+            it = ids.insert(std::make_pair(labels[sampleIdx], (int) _names.size())).first;
+            _names.push_back(labels[sampleIdx]);
+        }
+        _classes[sampleIdx] = it->second;
+    }
+}
+
+vector<std::string> Eigenfaces::labels() const {
+    vector<std::string> labels(_classes.size());
+    for (size_t sampleIdx = 0; sampleIdx < _classes.size(); sampleIdx++)
+        labels[sampleIdx] = _names[_classes[sampleIdx]];
+    return labels;
+}
+
+void Eigenfaces::setProjections(const Mat& projections) {
+    _built_transform.release();
+    _built_offset.release();
+    storeProjections(projections);
+    rebuild();
+}
+
+void Eigenfaces::storeProjections(const Mat& projections) {
+    int n = projections.rows;
+    int k = projections.cols;
+    if (projections.type() == CV_32FC1
+            && ((size_t) projections.data % 64) == 0
+            && (projections.step % 64) == 0) {
+        // already in the search layout (e.g. a mapped database), no copy
+        _projections = projections;
+    } else {
+        _projections = allocAligned(n, k, CV_32F);
+        projections.convertTo(_projections, CV_32F);
+    }
+    // no room to append in place, it may be mapped read only
+    _gallery = _projections;
+    _claimed = Mat(1, 1, CV_32S, Scalar(n));
+    _norms.resize(n);
+    for (int sampleIdx = 0; sampleIdx < n; sampleIdx++) {
+        const float* p = _projections.ptr<float>(sampleIdx);
+        _norms[sampleIdx] = dot32f(p, p, k);
+    }
+    setKernels();
+}
+
+void Eigenfaces::appendProjection(const Mat& projection) {
+    int n = _projections.rows;
+    int k = projection.cols;
+    // in place into the spare rows and columns of the gallery, unless a
+    // copy of this model sharing it took the row first
+    bool inPlace = n < _gallery.rows && k <= _gallery.cols
+            && CV_XADD(_claimed.ptr<int>(), 1) == n;
+    if (!inPlace) {
+        Mat gallery = allocAligned(n + n / 2 + 16, k + k / 4 + 4, CV_32F);
+        gallery.setTo(Scalar::all(0));
+        if (n > 0)
+            _projections.copyTo(gallery(Rect(0, 0, _projections.cols, n)));
+        _gallery = gallery;
+        _claimed = Mat(1, 1, CV_32S, Scalar(n + 1));
+    }
+    _projections = _gallery(Rect(0, 0, k, n + 1));
+    projection.copyTo(_projections.row(n));
+    const float* p = _projections.ptr<float>(n);
+    _norms.push_back(dot32f(p, p, k));
+}
+
+Mat Eigenfaces::projections() const {
+    if (_built_transform.empty())
+        return _projections;
+    // y = (z - offset) T' = z T' - offset T'
+    Mat T, center, projections;
+    _built_transform.convertTo(T, CV_32F);
+    Mat(_built_offset * _built_transform.t()).convertTo(center, CV_32F);
+    gemm(_projections, T, 1.0, Mat(), 0.0, projections, GEMM_2_T);
+    for (int sampleIdx = 0; sampleIdx < projections.rows; sampleIdx++) {
+        Mat y = projections.row(sampleIdx);
+        subtract(y, center, y);
+    }
+    return projections;
+}
+
+void Eigenfaces::rebuild() {
+    if (!_built_transform.empty()) {
+        Mat current = projections();
+        _built_transform.release();
+        _built_offset.release();
+        storeProjections(current);
+    }
+    _built_rows = _projections.rows;
+    _built_cols = _projections.cols;
+    _built_drift = _drift;
+    if (_nlist > 0)
+        _index.build(_projections, _nlist);
+    else
+        _index.clear();
+    _quantized.build(_projections, _quantization);
+    if (_prototypes_per_label > 0)
+        _prototypes.build(_projections, _classes, _names.size(), _prototypes_per_label, _prototype_method);
+    else
+        _prototypes.clear();
+    setCascade(_cascade);
+}
+
+void Eigenfaces::setKernels() {
+    _nearest = nearestKernel(_projections.cols);
+    _dot = dotKernel(_projections.cols);
+    // the float projection only pays off for sizes with a specialized kernel
+    _project = _mean.type() == CV_32F ? projectKernel(_eigenvectors.rows) : NULL;
+    _basis.release();
+    if (_project) {
+        _basis = allocAligned(_eigenvectors.cols, _eigenvectors.rows, CV_32F);
+        transpose(_eigenvectors).convertTo(_basis, CV_32F);
+    }
+}
+
+void Eigenfaces::setCascade(int prefix) {
+    _cascade = prefix;
+    int n = _projections.rows;
+    int k = _projections.cols;
+    _prefix.release();
+    _tail_norms.clear();
+    if (prefix <= 0 || prefix >= k)
+        return;
+    // the prefixes are scanned for every query, keep them dense
+    _prefix = allocAligned(n, prefix, CV_32F);
+    _projections.colRange(0, prefix).copyTo(_prefix);
+    _tail_norms.resize(n);
+    for (int sampleIdx = 0; sampleIdx < n; sampleIdx++) {
+        const float* p = _prefix.ptr<float>(sampleIdx);
+        _tail_norms[sampleIdx] = std::sqrt(std::max(_norms[sampleIdx] - dot32f(p, p, prefix), 0.0f));
+    }
+}
+
+void Eigenfaces::setIndex(int nlist) {
+    _nlist = nlist;
+    // the other structures are brought to the current projections as well
+    if (stale())
+        rebuild();
+    else if (_nlist > 0)
+        _index.build(_projections, _nlist);
+    else
+        _index.clear();
+}
+
+void Eigenfaces::setQuantization(QuantizedGallery::Type type, int rerank) {
+    _quantization = type;
+    _rerank = std::max(1, rerank);
+    if (stale())
+        rebuild();
+    else
+        _quantized.build(_projections, type);
+}
+
+void Eigenfaces::setPrototypes(int perLabel, PrototypeIndex::Method method, double margin) {
+    _prototypes_per_label = perLabel;
+    _prototype_method = method;
+    _margin = margin;
+    if (stale())
+        rebuild();
+    else if (perLabel > 0)
+        _prototypes.build(_projections, _classes, _names.size(), perLabel, method);
+    else
+        _prototypes.clear();
+}
+
+double Eigenfaces::quantization_agreement(int samples, double& distanceError) const {
+    distanceError = 0;
+    int n = _projections.rows;
+    int k = _projections.cols;
+    if (n < 2 || samples <= 0 || _quantized.empty())
+        return 1.0;
+    samples = std::min(samples, n);
+    int agree = 0;
+    QuantizedGallery::Candidates candidates;
+    for (int s = 0; s < samples; s++) {
+        int sampleIdx = (int) ((long long) s * n / samples);
+        const float* q = _projections.ptr<float>(sampleIdx);
+        // exact nearest neighbour, leaving the sample out
+        float exactDist = numeric_limits<float>::max();
+        int exactIdx = -1;
+        for (int i = 0; i < n; i++) {
+            if (i == sampleIdx)
+                continue;
+            float d = l2sqr32f(q, _projections.ptr<float>(i), k);
+            if (d < exactDist) {
+                exactDist = d;
+                exactIdx = i;
+            }
+        }
+        float minDist;
+        int minIdx = search(q, minDist, candidates, sampleIdx);
+        if (minIdx >= 0 && _classes[minIdx] == _classes[exactIdx])
+            agree++;
+        if (exactDist > 0)
+            distanceError += std::fabs(std::sqrt(minDist) - std::sqrt(exactDist)) / std::sqrt(exactDist);
+    }
+    distanceError /= samples;
+    return (double) agree / samples;
+}
+
+std::string Eigenfaces::predict(const Mat& src, double& dist) const {
+    Workspace ws;
+    return predict(src, dist, ws);
+}
+
+std::string Eigenfaces::predict(const Mat& src, double& dist, Workspace& ws) const {
+    if (reserveMat(ws.sample, 1, src.total(), _mean.type()))
+        ws.allocations++;
+    src.reshape(1, 1).convertTo(ws.sample, _mean.type());
+    if (reserveMat(ws.centered, 1, src.total(), _mean.type()))
+        ws.allocations++;
+    subtract(ws.sample, _mean.reshape(1, 1), ws.centered);
+    return predictCentered(dist, ws);
+}
+
+std::string Eigenfaces::predictCentered(double& dist, Workspace& ws) const {
+    int64 start = getTickCount();
+    project(ws.centered, ws);
+    ws.project_time = (getTickCount() - start) / getTickFrequency();
+    return predictProjected(dist, ws);
+}
+
+std::string Eigenfaces::predictProjected(double& dist, Workspace& ws) const {
+    int64 start = getTickCount();
     // find 1-nearest neighbor
-    double minDist = numeric_limits<double>::max();
-    std::string minClass = "";
-    for (int sampleIdx = 0; sampleIdx < _projections.size(); sampleIdx++) {
-        dist = norm(_projections[sampleIdx], q, NORM_L2);
-        if (dist < minDist) {
-            minDist = dist;
-            minClass = _labels[sampleIdx];
+    dist = numeric_limits<double>::max();
+    float minDist;
+    // the candidates hold the lists of the index, or else the rows to re-rank
+    int needed = !_index.empty() ? _index.lists() : (_quantized.empty() ? 0 : _rerank);
+    if ((int) ws.candidates.capacity() < needed)
+        ws.allocations++;
+    AutoBuffer<float> buffer(_projections.cols);
+    int minIdx = search(storedQuery(ws.query.ptr<float>(), buffer), minDist, ws.candidates);
+    ws.search_time = (getTickCount() - start) / getTickFrequency();
+    if (minIdx < 0)
+        return "";
+    dist = std::sqrt(minDist);
+    return _names[_classes[minIdx]];
+}
+
+int Eigenfaces::searchCascade(const float* q, float& minDist) const {
+    int k = _projections.cols;
+    int prefix = _prefix.cols;
+    float qq = _dot(q, q, k);
+    float qTail = std::sqrt(std::max(qq - dot32f(q, q, prefix), 0.0f));
+    // the distances are computed as in _nearest, so the results are the same
+    float best = numeric_limits<float>::max();
+    int bestIdx = -1;
+    for (int i = 0; i < _prefix.rows; i++) {
+        float tail = qTail - _tail_norms[i];
+        float bound = l2sqr32f(q, _prefix.ptr<float>(i), prefix) + tail * tail;
+        if (bound - CASCADE_SLACK * (qq + _norms[i]) > best + qq)
+            continue;
+        float d = _norms[i] - 2 * _dot(q, _projections.ptr<float>(i), k);
+        if (d < best) {
+            best = d;
+            bestIdx = i;
+        }
+    }
+    if (bestIdx >= 0) {
+        best += qq;
+        minDist = best > 0 ? best : 0;
+    }
+    // the projections appended since the prefixes were copied
+    return searchAdded(q, _prefix.rows, bestIdx, minDist, -1);
+}
+
+int Eigenfaces::search(const float* q, float& minDist, QuantizedGallery::Candidates& candidates,
+        int exclude) const {
+    minDist = numeric_limits<float>::max();
+    if (_projections.empty())
+        return -1;
+    // the index, the codes and the prototypes miss the projections appended
+    // since they were built, and their distances the columns added since
+    bool widened = _projections.cols != _built_cols;
+    if (!_prototypes.empty() && exclude < 0) {
+        float otherDist;
+        int minIdx = _prototypes.search(q, minDist, otherDist);
+        // trust the prototypes unless another label is about as near
+        double scale = (1 + _margin) * (1 + _margin);
+        if (otherDist >= scale * minDist) {
+            // the threshold applies to distances to samples, not to cluster centres
+            if (_prototype_method == PrototypeIndex::KMEANS)
+                minIdx = _prototypes.nearestMember(q, _projections, _norms, _classes[minIdx], minDist);
+            else if (widened)
+                minDist = distance(q, minIdx);
+            return searchAdded(q, _built_rows, minIdx, minDist, exclude);
+        }
+        minDist = numeric_limits<float>::max();
+    }
+    // the index cannot leave a row out, rows are excluded only to measure
+    // the compressed pass, which the index would bypass anyway. It ranks
+    // its lists in the candidates, which the compressed pass does not need then.
+    if (!_index.empty() && exclude < 0) {
+        int minIdx = _index.search(q, _nprobe, minDist, candidates);
+        if (minIdx >= 0 && widened)
+            minDist = distance(q, minIdx);
+        return searchAdded(q, _built_rows, minIdx, minDist, exclude);
+    }
+    if (_quantized.empty()) {
+        int shards = shardCount(_projections.rows);
+        if (shards == 1 && !_prefix.empty())
+            return searchCascade(q, minDist);
+        if (shards == 1)
+            return _nearest(q, _projections.ptr<float>(), _projections.step,
+                &_norms[0], _projections.rows, _projections.cols, minDist);
+        // search the shards in parallel and merge their winners
+        AutoBuffer<std::pair<float, int> > results(shards);
+        parallel_for_(Range(0, shards), ShardSearch(_nearest, q, _projections, &_norms[0], shards, results));
+        std::pair<float, int> best = *std::min_element((std::pair<float, int>*) results,
+                (std::pair<float, int>*) results + shards);
+        minDist = best.first;
+        return best.second;
+    }
+    // re-rank the best rows of the compressed scan with the exact floats
+    int k = _projections.cols;
+    _quantized.search(q, _rerank, candidates, exclude);
+    int minIdx = -1;
+    for (size_t i = 0; i < candidates.size(); i++) {
+        int sampleIdx = candidates[i].second;
+        float d = _norms[sampleIdx] - 2 * dot32f(q, _projections.ptr<float>(sampleIdx), k);
+        if (d < minDist) {
+            minDist = d;
+            minIdx = sampleIdx;
         }
     }
-    return minClass;
+    if (minIdx >= 0)
+        minDist = std::max(minDist + dot32f(q, q, k), 0.0f);
+    return searchAdded(q, _built_rows, minIdx, minDist, exclude);
+}
+
+const float* Eigenfaces::storedQuery(const float* q, float* buffer) const {
+    if (_built_transform.empty())
+        return q;
+    int k = _built_transform.rows;
+    int storedK = _built_transform.cols;
+    const double* offset = _built_offset.ptr<double>();
+    for (int j = 0; j < storedK; j++)
+        buffer[j] = (float) offset[j];
+    for (int i = 0; i < k; i++) {
+        const double* t = _built_transform.ptr<double>(i);
+        for (int j = 0; j < storedK; j++)
+            buffer[j] += (float) (q[i] * t[j]);
+    }
+    return buffer;
 }
 
-Mat Eigenfaces::project(const Mat& src) {
+int Eigenfaces::searchAdded(const float* q, int first, int minIdx, float& minDist, int exclude) const {
+    for (int sampleIdx = first; sampleIdx < _projections.rows; sampleIdx++) {
+        if (sampleIdx == exclude)
+            continue;
+        float d = distance(q, sampleIdx);
+        if (d < minDist) {
+            minDist = d;
+            minIdx = sampleIdx;
+        }
+    }
+    return minIdx;
+}
+
+float Eigenfaces::distance(const float* q, int sampleIdx) const {
+    int k = _projections.cols;
+    float d = _norms[sampleIdx] - 2 * dot32f(q, _projections.ptr<float>(sampleIdx), k) + dot32f(q, q, k);
+    return std::max(d, 0.0f);
+}
+
+void Eigenfaces::predictTopK(const Mat& src, int count, bool perLabel,
+        vector<std::string>& labels, vector<double>& dists) const {
+    Workspace ws;
+    src.reshape(1, 1).convertTo(ws.sample, _mean.type());
+    subtract(ws.sample, _mean.reshape(1, 1), ws.centered);
+    predictTopKCentered(count, perLabel, labels, dists, ws);
+}
+
+void Eigenfaces::predictTopKCentered(int count, bool perLabel,
+        vector<std::string>& labels, vector<double>& dists, Workspace& ws) const {
+    project(ws.centered, ws);
+    predictTopKProjected(count, perLabel, labels, dists, ws);
+}
+
+void Eigenfaces::predictTopKProjected(int count, bool perLabel,
+        vector<std::string>& labels, vector<double>& dists, Workspace& ws) const {
+    AutoBuffer<float> buffer(_projections.cols);
+    nearest(storedQuery(ws.query.ptr<float>(), buffer), count, perLabel, ws);
+    labels.resize(ws.nearest.size());
+    dists.resize(ws.nearest.size());
+    for (size_t i = 0; i < ws.nearest.size(); i++) {
+        labels[i] = _names[_classes[ws.nearest[i].second]];
+        dists[i] = std::sqrt(ws.nearest[i].first);
+    }
+}
+
+void Eigenfaces::nearest(const float* q, int count, bool perLabel, Workspace& ws) const {
+    ws.nearest.clear();
+    int n = _projections.rows;
+    int k = _projections.cols;
+    if (n == 0 || count <= 0)
+        return;
+    float qq = dot32f(q, q, k);
+    // the compressed scan narrows the rows down, but must leave enough
+    // of them for count results
+    bool narrowed = !_quantized.empty();
+    if (narrowed) {
+        _quantized.search(q, std::max(_rerank, perLabel ? count * _rerank : count), ws.candidates);
+        // the codes do not hold the projections added since they were built
+        for (int sampleIdx = _built_rows; sampleIdx < n; sampleIdx++)
+            ws.candidates.push_back(std::make_pair(0.0f, sampleIdx));
+    }
+    int rows = narrowed ? (int) ws.candidates.size() : n;
+    if (perLabel)
+        ws.classBest.assign(_names.size(), std::make_pair(numeric_limits<float>::max(), -1));
+    int shards = narrowed ? 1 : shardCount(n);
+    if (shards > 1) {
+        // every shard keeps its own results, merged into ws.nearest below
+        if ((int) ws.shardNearest.size() != shards)
+            ws.allocations++;
+        ws.shardNearest.resize(shards);
+        ws.shardClassBest.resize(shards);
+        for (int shard = 0; shard < shards; shard++) {
+            if (perLabel)
+                ws.shardClassBest[shard].assign(_names.size(),
+                    std::make_pair(numeric_limits<float>::max(), -1));
+        }
+        parallel_for_(Range(0, shards), ShardNearest(q, _projections, _norms, _classes,
+                count, perLabel, ws));
+        for (int shard = 0; shard < shards; shard++) {
+            if (!perLabel) {
+                for (size_t i = 0; i < ws.shardNearest[shard].size(); i++)
+                    keepNearest(ws.nearest, count, ws.shardNearest[shard][i]);
+                continue;
+            }
+            for (size_t classIdx = 0; classIdx < _names.size(); classIdx++)
+                ws.classBest[classIdx] = std::min(ws.classBest[classIdx], ws.shardClassBest[shard][classIdx]);
+        }
+        // the shards replace the single pass
+        rows = 0;
+    }
+    // bounds of the cascade, for the rows not narrowed down already and
+    // not appended since the prefixes were copied
+    bool bounded = !narrowed && !_prefix.empty();
+    float qTail = bounded ? std::sqrt(std::max(qq - dot32f(q, q, _prefix.cols), 0.0f)) : 0;
+    // a single pass, keeping either the best rows or the best row per label
+    for (int i = 0; i < rows; i++) {
+        int sampleIdx = narrowed ? ws.candidates[i].second : i;
+        if (bounded && sampleIdx < _prefix.rows) {
+            float worst = perLabel ? ws.classBest[_classes[sampleIdx]].first
+                    : ((int) ws.nearest.size() < count ? numeric_limits<float>::max() : ws.nearest.front().first);
+            float tail = qTail - _tail_norms[sampleIdx];
+            float bound = l2sqr32f(q, _prefix.ptr<float>(sampleIdx), _prefix.cols) + tail * tail;
+            if (bound - CASCADE_SLACK * (qq + _norms[sampleIdx]) > worst)
+                continue;
+        }
+        float d = _norms[sampleIdx] - 2 * dot32f(q, _projections.ptr<float>(sampleIdx), k) + qq;
+        std::pair<float, int> entry(std::max(d, 0.0f), sampleIdx);
+        if (!perLabel)
+            keepNearest(ws.nearest, count, entry);
+        else if (entry < ws.classBest[_classes[sampleIdx]])
+            ws.classBest[_classes[sampleIdx]] = entry;
+    }
+    if (perLabel) {
+        for (size_t classIdx = 0; classIdx < _names.size(); classIdx++) {
+            if (ws.classBest[classIdx].second >= 0)
+                keepNearest(ws.nearest, count, ws.classBest[classIdx]);
+        }
+    }
+    std::sort_heap(ws.nearest.begin(), ws.nearest.end());
+}
+
+int Eigenfaces::shardCount(int rows) const {
+    return std::max(1, std::min(_shards, rows / MIN_SHARD_ROWS));
+}
+
+void Eigenfaces::predict(const vector<Mat>& src, vector<std::string>& labels, vector<double>& dists) const {
+    int n = src.size();
+    labels.assign(n, "");
+    dists.assign(n, numeric_limits<double>::max());
+    if (n == 0 || _projections.empty())
+        return;
+    // project all samples with a single gemm, one query per row
+    Mat Q = _dataAsRow ? project(asRowMatrix(src, _mean.type()))
+            : transpose(project(asColumnMatrix(src, _mean.type())));
+    Q.convertTo(Q, CV_32F);
+    if (!_built_transform.empty()) {
+        // to the basis of the stored projections
+        Mat T, offset, stored;
+        _built_transform.convertTo(T, CV_32F);
+        _built_offset.convertTo(offset, CV_32F);
+        gemm(Q, T, 1.0, repeat(offset, n, 1), 1.0, stored);
+        Q = stored;
+    }
+    int k = _projections.cols;
+    if (!_index.empty() || !_quantized.empty()) {
+        QuantizedGallery::Candidates candidates;
+        for (int queryIdx = 0; queryIdx < n; queryIdx++) {
+            float minDist;
+            int minIdx = search(Q.ptr<float>(queryIdx), minDist, candidates);
+            if (minIdx >= 0) {
+                dists[queryIdx] = std::sqrt(minDist);
+                labels[queryIdx] = _names[_classes[minIdx]];
+            }
+        }
+        return;
+    }
+    vector<float> minDists(n, numeric_limits<float>::max());
+    vector<int> minIdx(n, -1);
+    // blocks of the gallery stay in cache while all queries pass over them
+    for (int start = 0; start < _projections.rows; start += BLOCK_SIZE) {
+        int end = std::min(_projections.rows, start + BLOCK_SIZE);
+        for (int queryIdx = 0; queryIdx < n; queryIdx++) {
+            const float* q = Q.ptr<float>(queryIdx);
+            for (int sampleIdx = start; sampleIdx < end; sampleIdx++) {
+                float d = _norms[sampleIdx] - 2 * dot32f(q, _projections.ptr<float>(sampleIdx), k);
+                if (d < minDists[queryIdx]) {
+                    minDists[queryIdx] = d;
+                    minIdx[queryIdx] = sampleIdx;
+                }
+            }
+        }
+    }
+    for (int queryIdx = 0; queryIdx < n; queryIdx++) {
+        const float* q = Q.ptr<float>(queryIdx);
+        float d = minDists[queryIdx] + dot32f(q, q, k);
+        dists[queryIdx] = std::sqrt(std::max(d, 0.0f));
+        labels[queryIdx] = _names[_classes[minIdx[queryIdx]]];
+    }
+}
+
+Mat Eigenfaces::project(const Mat& src) const {
     Mat data, X, Y;
     int n = _dataAsRow ? src.rows : src.cols;
     // convert to correct type
     src.convertTo(data, _mean.type());
-    // center data
-    subtract(_dataAsRow ? data : transpose(data),
-            repeat(_mean.reshape(1, 1), n, 1),
-            X);
+    // center data, row by row instead of repeating the mean n times
+    X = _dataAsRow ? data : transpose(data);
+    Mat mean = _mean.reshape(1, 1);
+    for (int i = 0; i < n; i++) {
+        Mat row = X.row(i);
+        subtract(row, mean, row);
+    }
     // Y = (X-mean)*W
     gemm(X, _eigenvectors, 1.0, Mat(), 0.0, Y);
     return _dataAsRow ? Y : transpose(Y);
 }
 
-Mat Eigenfaces::reconstruct(const Mat& src) {
+void Eigenfaces::project(const Mat& centered, Workspace& ws) const {
+    // the destinations keep their buffers once they have the right size
+    if (_project && centered.type() == CV_32F && centered.isContinuous()) {
+        if (reserveMat(ws.query, 1, _basis.rows, CV_32F))
+            ws.allocations++;
+        _project(centered.ptr<float>(), _basis.ptr<float>(), _basis.step, _basis.rows, _basis.cols,
+                ws.query.ptr<float>());
+        // the mean is CV_32F, so the projection has the type of the query
+        if (reserveMat(ws.projection, 1, _basis.rows, CV_32F))
+            ws.allocations++;
+        ws.query.copyTo(ws.projection);
+        return;
+    }
+    if (reserveMat(ws.projection, 1, _eigenvectors.cols, _mean.type()))
+        ws.allocations++;
+    gemm(centered, _eigenvectors, 1.0, Mat(), 0.0, ws.projection);
+    if (reserveMat(ws.query, 1, _eigenvectors.cols, CV_32F))
+        ws.allocations++;
+    ws.projection.convertTo(ws.query, CV_32F);
+}
+
+double Eigenfaces::faceSpaceDistance(const Workspace& ws) const {
+    // the eigenvectors are orthonormal, so the energy of the residual is the
+    // energy of the sample less the energy of its projection
+    double residual = norm(ws.centered, NORM_L2SQR) - norm(ws.projection, NORM_L2SQR);
+    return std::sqrt(std::max(residual, 0.0));
+}
+
+Mat Eigenfaces::reconstruct(const Mat& src) const {
     Mat X;
     int n = _dataAsRow ? src.rows : src.cols;
     // X = Y*W'+mean
@@ -20,6 +20,10 @@
 #define EIGENFACES_HPP_
 
 #include "opencv2/opencv.hpp"
+#include "distance.hpp"
+#include "ivfindex.hpp"
+#include "prototypeindex.hpp"
+#include "quantizedgallery.hpp"
 #include <limits.h>
 #include <vector>
 #include <string>
@@ -28,23 +32,84 @@ using namespace std;
 using namespace cv;
 
 class Eigenfaces {
+public:
+	//! solvers for the PCA in compute()
+	enum Solver {
+		SOLVER_AUTO, //!< picks one of the others from the size of the data
+		SOLVER_OPENCV, //!< cv::PCA
+		SOLVER_SNAPSHOT, //!< eigenvectors of the n x n Gram matrix, for n << d
+		SOLVER_RANDOMIZED, //!< randomized truncated SVD, for few components of much data
+		SOLVER_STREAMING //!< sketch built in chunks of samples, for data larger than the memory
+	};
+
+	//! buffers for predicting single samples, reusable between calls of one thread
+	struct Workspace {
+		Mat sample; //!< sample in the type of the mean
+		Mat centered; //!< sample minus the mean
+		Mat projection; //!< projection in the type of the mean
+		Mat query; //!< projection as a CV_32F row
+		QuantizedGallery::Candidates candidates; //!< rows to re-rank, or lists of the index to probe
+		QuantizedGallery::Candidates nearest; //!< (squared distance, row) of the best rows
+		QuantizedGallery::Candidates classBest; //!< best row of every label
+		vector<QuantizedGallery::Candidates> shardNearest; //!< best rows of every shard
+		vector<QuantizedGallery::Candidates> shardClassBest; //!< best row of every label of every shard
+		unsigned allocations; //!< number of times a buffer was (re)allocated
+		double project_time; //!< seconds the last predict spent projecting
+		double search_time; //!< seconds the last predict spent searching
+		Workspace() : allocations(0), project_time(0), search_time(0) {};
+	};
+
 private:
 	bool _dataAsRow;
 	int _num_components;
-	vector<Mat> _projections;
-	vector<std::string> _labels;
+	int _max_components; // upper bound for the components of update()
+	double _drift; // variance discarded by update() since compute()
+	Mat _projections; // one CV_32F projection per row in the stored basis, rows 64 byte aligned
+	vector<float> _norms; // squared norms of the projections
+	vector<int> _classes; // label id of every projection
+	vector<std::string> _names; // label of every id, each stored once
+	IVFIndex _index; // optional approximate search over the projections
+	int _nlist;
+	int _nprobe;
+	PrototypeIndex _prototypes; // optional prototypes of every label searched first
+	int _prototypes_per_label;
+	PrototypeIndex::Method _prototype_method;
+	double _margin; // relative distance margin below which the prototypes are not trusted
+	// the projections stay in the basis of the last rebuild(), update() folds
+	// its rotation into _built_transform and maps the queries instead; the
+	// index, the codes, the prototypes and the cascade hold the first
+	// _built_rows projections
+	Mat _gallery; // rows and columns the projections grow into, zero beyond them
+	Mat _claimed; // CV_32S count of the rows of _gallery taken, shared by the copies
+	Mat _built_transform; // CV_64F T, a current projection y is stored as y T + offset, empty if identity
+	Mat _built_offset; // CV_64F
+	int _built_rows;
+	int _built_cols; // projections.cols when they were built
+	double _built_drift; // _drift when they were built
+	QuantizedGallery _quantized; // optional compressed first pass over the projections
+	QuantizedGallery::Type _quantization;
+	int _rerank; // candidates of the compressed pass re-ranked with the floats
+	int _shards; // contiguous ranges of the projections searched in parallel
+	NearestKernel _nearest; // exhaustive search specialized for the number of components
+	DotKernel _dot; // the dot product _nearest uses
+	int _cascade; // leading components that bound the distance before the full one, 0 - off
+	Mat _prefix; // leading _cascade components of the projections, rows 64 byte aligned
+	vector<float> _tail_norms; // norms of the remaining components of the projections
+	ProjectKernel _project; // projection specialized for the sample size, NULL if there is none
+	Mat _basis; // eigenvectors as 64 byte aligned CV_32F rows, for _project
 	Mat _eigenvectors;
 	Mat _eigenvalues;
 	Mat _mean;
+	Solver _solver;
+	Solver _solver_used; // solver of the last compute()
+	int _chunk_rows; // samples converted at a time by the streaming solver
+	double _compute_time; // seconds spent in the solver
+	double _reconstruction_error; // variance not explained by the eigenvectors, relative
 
 public:
-	Eigenfaces() :
-		_num_components(0),
-		_dataAsRow(true) {};
+	Eigenfaces() { init(0, true); };
 	//! create empty eigenfaces with num_components
-	Eigenfaces(int num_components, bool dataAsRow = true) :
-		_num_components(num_components),
-		_dataAsRow(dataAsRow) {};
+	Eigenfaces(int num_components, bool dataAsRow = true) { init(num_components, dataAsRow); };
 	//! compute num_component eigenfaces for given images in src and corresponding classes in labels
 	Eigenfaces(const vector<Mat>& src,
 			const vector<std::string>& labels,
@@ -60,18 +125,171 @@ public:
 	void compute(const vector<Mat>& src, const vector<std::string>& labels);
 	//! computes a PCA for given data
 	void compute(const Mat& src, const vector<std::string>& labels);
+	//! selects the solver of the following compute() calls
+	void setSolver(Solver solver) { _solver = solver; }
+	//! sets the number of samples the streaming solver holds in memory at a time
+	void setChunkRows(int rows) { _chunk_rows = std::max(1, rows); }
+	//! returns the solver used by the last compute()
+	Solver solver() const { return _solver_used; }
+	//! returns the time in seconds the solver of the last compute() took
+	double compute_time() const { return _compute_time; }
+	//! returns the fraction of the variance of the data not explained by the eigenvectors
+	double reconstruction_error() const { return _reconstruction_error; }
+	//! restores a previously computed PCA and its projections
+	void load(const Mat& mean,
+			const Mat& eigenvalues,
+			const Mat& eigenvectors,
+			const Mat& projections,
+			const vector<std::string>& labels);
+	/**
+	 * Adds a sample to the computed PCA without recomputing it.
+	 * The index, the codes and the prototypes are rebuilt only after a tenth
+	 * of the samples was added or the drift grew by 0.01, meanwhile the
+	 * samples added since are searched exhaustively.
+	 */
+	void update(const Mat& src, const std::string& label);
+	//! returns the variance discarded by update() relative to the variance kept
+	double drift() const { return _drift; }
 	//! predicts the label for a given sample
-	std::string predict(const Mat& src,double& dist);
+	std::string predict(const Mat& src,double& dist) const;
+	//! predicts the label for a given sample using the buffers in ws
+	std::string predict(const Mat& src, double& dist, Workspace& ws) const;
+	//! predicts the label for the sample minus the mean already in ws.centered
+	std::string predictCentered(double& dist, Workspace& ws) const;
+	//! predicts the label for the projection already in ws.query
+	std::string predictProjected(double& dist, Workspace& ws) const;
+	/**
+	 * Predicts the count nearest training samples, nearest first
+	 * With perLabel only the nearest sample of each label is reported, so
+	 * the result holds count distinct labels. Labels and distances are
+	 * stored in labels and dists.
+	 */
+	void predictTopK(const Mat& src, int count, bool perLabel,
+			vector<std::string>& labels, vector<double>& dists) const;
+	//! predictTopK for the sample minus the mean already in ws.centered
+	void predictTopKCentered(int count, bool perLabel,
+			vector<std::string>& labels, vector<double>& dists, Workspace& ws) const;
+	//! predictTopK for the projection already in ws.query
+	void predictTopKProjected(int count, bool perLabel,
+			vector<std::string>& labels, vector<double>& dists, Workspace& ws) const;
+	//! predicts the labels and distances for a batch of samples
+	void predict(const vector<Mat>& src, vector<std::string>& labels, vector<double>& dists) const;
+	//! searches an inverted file index with nlist lists, 0 searches all projections
+	void setIndex(int nlist);
+	//! sets the number of index lists searched per sample
+	void setProbes(int nprobe) { _nprobe = nprobe; }
+	/**
+	 * Searches at most perLabel prototypes of every label, 0 disables them
+	 * The prototypes are the k-means centres of the projections of a label
+	 * or their medoids. If the nearest prototype of another label is less
+	 * than margin (relative) further away than the winner, the sample is
+	 * searched among all projections instead.
+	 */
+	void setPrototypes(int perLabel, PrototypeIndex::Method method, double margin);
+	//! returns the number of prototypes searched, 0 if they are disabled
+	int prototypes() const { return _prototypes.size(); }
+	/**
+	 * Splits the exhaustive search into shards searched in parallel
+	 * The shards are contiguous ranges of the projections, so they need no
+	 * rebuilding when the projections change. Galleries too small to
+	 * benefit are searched with fewer shards, 1 disables the sharding.
+	 */
+	void setShards(int shards) { _shards = std::max(1, shards); }
+	//! returns the number of shards the exhaustive search is split into
+	int shards() const { return _shards; }
+	/**
+	 * Bounds the distance to every projection by its first prefix components.
+	 * The partial distance plus the squared difference of the norms of the
+	 * remaining components never exceeds the full distance, projections
+	 * whose bound is above the best distance so far are skipped. The
+	 * results are the ones of the exhaustive search. 0 disables it.
+	 */
+	void setCascade(int prefix);
+	//! returns the number of components of the cascade, 0 if it is off
+	int cascade() const { return _cascade; }
+	//! scans compressed projections first and re-ranks the best rerank rows exactly
+	void setQuantization(QuantizedGallery::Type type, int rerank);
+	//! returns the size of the compressed projections in bytes
+	size_t quantized_bytes() const { return _quantized.bytes(); }
+	/**
+	 * Compares the compressed search to the exact one
+	 * Searches the nearest neighbour of up to samples training projections,
+	 * leaving the projection itself out. Returns the fraction of labels that
+	 * agree, distanceError gets the mean relative error of the distances.
+	 */
+	double quantization_agreement(int samples, double& distanceError) const;
 	//! projects a sample
-	Mat project(const Mat& src);
+	Mat project(const Mat& src) const;
+	//! projects a single sample minus the mean into ws.query
+	void project(const Mat& centered, Workspace& ws) const;
+	/**
+	 * Returns the distance of ws.centered from the face space
+	 * Computed from the projection project() left in ws, the sample is not
+	 * reconstructed. Samples far from the face space are not faces.
+	 */
+	double faceSpaceDistance(const Workspace& ws) const;
 	//! reconstructs a sample
-	Mat reconstruct(const Mat& src);
+	Mat reconstruct(const Mat& src) const;
 	//! returns the eigenvectors of this PCA
 	Mat eigenvectors() const { return _eigenvectors; }
 	//! returns the eigenvalues of this PCA
 	Mat eigenvalues() const { return _eigenvalues; }
 	//! returns the mean of this PCA
 	Mat mean() const { return _mean; }
+	//! returns the projections of the training samples in the current basis, one per row
+	Mat projections() const;
+	//! returns the labels of the training samples
+	vector<std::string> labels() const;
+	//! returns the label id of every training sample
+	const vector<int>& classes() const { return _classes; }
+	//! returns the label of every label id
+	const vector<std::string>& names() const { return _names; }
+	//! returns the number of training samples
+	int num_samples() const { return _classes.size(); }
+	//! returns the number of components of this PCA
+	int num_components() const { return _num_components; }
+
+private:
+	//! returns the nearest projection to the stored CV_32F row q, -1 if there is none
+	int search(const float* q, float& minDist, QuantizedGallery::Candidates& candidates,
+			int exclude = -1) const;
+	//! interns the labels of the training samples
+	void setLabels(const vector<std::string>& labels);
+	//! stores the count nearest rows to the stored q in ws.nearest, nearest first
+	void nearest(const float* q, int count, bool perLabel, Workspace& ws) const;
+	//! sets every member to its default, shared by the constructors
+	void init(int num_components, bool dataAsRow);
+	//! exhaustive nearest neighbour search pruned by the cascade bounds
+	int searchCascade(const float* q, float& minDist) const;
+	//! returns the number of shards a search of rows projections is split into
+	int shardCount(int rows) const;
+	//! eigenvectors from the Gram matrix of the samples
+	void computeSnapshot(const Mat& data, Mat& mean, Mat& eigenvalues, Mat& eigenvectors);
+	//! leading eigenvectors from a randomized truncated SVD
+	void computeRandomized(const Mat& data, Mat& mean, Mat& eigenvalues, Mat& eigenvectors);
+	//! computes the PCA and the projections passing over the samples in chunks
+	void computeStreaming(const vector<Mat>& src, const vector<std::string>& labels);
+	//! stores the projections and rebuilds everything that searches them
+	void setProjections(const Mat& projections);
+	//! stores the projections as aligned float rows and computes their norms
+	void storeProjections(const Mat& projections);
+	//! appends a stored projection, in place if the gallery has room for it
+	void appendProjection(const Mat& projection);
+	//! rotates the projections to the current basis and builds everything that searches them
+	void rebuild();
+	//! returns true if they do not hold the current projections
+	bool stale() const {
+		return _built_rows != _projections.rows || _built_cols != _projections.cols
+				|| !_built_transform.empty();
+	}
+	//! maps the CV_32F projection q to the basis of the stored projections, into buffer
+	const float* storedQuery(const float* q, float* buffer) const;
+	//! returns the nearest of minIdx and the projections from first on
+	int searchAdded(const float* q, int first, int minIdx, float& minDist, int exclude) const;
+	//! returns the squared distance of the stored query q to the projection sampleIdx
+	float distance(const float* q, int sampleIdx) const;
+	//! selects the kernels specialized for the sizes of the model
+	void setKernels();
 };
 
 #endif /* EIGENFACES_H_ */
@@ -0,0 +1,262 @@
+/*
+ * Face recognition based on Eigenfaces for Urbi
+ * Copyright (C) 2012  Lukasz Malek
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * File:   facedatabase.cpp
+ */
+
+#include "facedatabase.hpp"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+using namespace boost::interprocess;
+
+namespace {
+
+    const char MAGIC[8] = {'U', 'E', 'I', 'G', 'F', 'D', 'B', '\0'};
+    const boost::uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+    boost::uint64_t alignOffset(boost::uint64_t offset) {
+        return (offset + FaceDatabase::ALIGNMENT - 1) & ~(boost::uint64_t) (FaceDatabase::ALIGNMENT - 1);
+    }
+
+    void pad(std::ofstream& ofs) {
+        static const char zeros[FaceDatabase::ALIGNMENT] = {0};
+        boost::uint64_t offset = ofs.tellp();
+        ofs.write(zeros, alignOffset(offset) - offset);
+    }
+
+    //! writes a matrix as a dense aligned block and describes it in block
+    template<typename Block>
+    void writeMatrix(std::ofstream& ofs, const cv::Mat& m, Block& block) {
+        pad(ofs);
+        block.offset = ofs.tellp();
+        block.rows = m.rows;
+        block.cols = m.cols * m.channels();
+        block.type = m.depth();
+        block.reserved = 0;
+        for (int i = 0; i < m.rows; i++)
+            ofs.write((const char*) m.ptr(i), m.cols * m.elemSize());
+    }
+
+} // namespace
+
+FaceDatabase::FaceDatabase(const std::string& fileName) :
+    file(fileName.c_str(), read_only),
+    region(file, read_only),
+    header(NULL) {
+    if (region.get_size() < sizeof (Header))
+        throw std::runtime_error("[FaceDatabase] : File too short: " + fileName);
+    header = static_cast<const Header*> (region.get_address());
+    if (memcmp(header->magic, MAGIC, sizeof (MAGIC)) != 0)
+        throw std::runtime_error("[FaceDatabase] : Not a face database: " + fileName);
+    if (header->byteOrder != BYTE_ORDER_MARK)
+        throw std::runtime_error("[FaceDatabase] : Unsupported byte order: " + fileName);
+    if (header->version != VERSION)
+        throw std::runtime_error("[FaceDatabase] : Unsupported version: " + fileName);
+    checkBlock(header->faceLabels);
+    checkBlock(header->images);
+    checkBlock(header->mean);
+    checkBlock(header->eigenvalues);
+    checkBlock(header->eigenvectors);
+    checkBlock(header->projections);
+    checkBlock(header->modelLabels);
+    if (header->images.rows != header->faceCount
+            || header->images.cols != (boost::uint32_t) (header->faceWidth * header->faceHeight))
+        throw std::runtime_error("[FaceDatabase] : Invalid image block: " + fileName);
+
+    // string table: length prefixed labels
+    const char* begin = static_cast<const char*> (region.get_address());
+    const char* end = begin + region.get_size();
+    const char* p = begin + header->labelsOffset;
+    for (boost::uint32_t i = 0; i < header->labelCount; i++) {
+        boost::uint32_t length;
+        if (p + sizeof (length) > end)
+            throw std::runtime_error("[FaceDatabase] : Invalid label table: " + fileName);
+        memcpy(&length, p, sizeof (length));
+        p += sizeof (length);
+        if (p + length > end)
+            throw std::runtime_error("[FaceDatabase] : Invalid label table: " + fileName);
+        labels.push_back(std::string(p, length));
+        p += length;
+    }
+}
+
+bool FaceDatabase::isDatabase(const std::string& fileName) {
+    char magic[sizeof (MAGIC)];
+    std::ifstream ifs(fileName.c_str(), std::ios::binary);
+    if (!ifs.read(magic, sizeof (magic)))
+        return false;
+    return memcmp(magic, MAGIC, sizeof (MAGIC)) == 0;
+}
+
+void FaceDatabase::write(const std::string& fileName, int faceWidth, int faceHeight,
+        int numComponents, double threshold, const FaceStore& faces,
+        const Eigenfaces* model) {
+    Header h;
+    memset(&h, 0, sizeof (h));
+    memcpy(h.magic, MAGIC, sizeof (MAGIC));
+    h.byteOrder = BYTE_ORDER_MARK;
+    h.version = VERSION;
+    h.faceWidth = faceWidth;
+    h.faceHeight = faceHeight;
+    h.numComponents = numComponents;
+    h.faceCount = faces.size();
+    h.threshold = threshold;
+
+    // the label table starts with the labels of the faces, so their ids
+    // can be stored as they are
+    std::vector<std::string> table = faces.names();
+    cv::Mat faceLabels(faces.size(), 1, CV_32S);
+    cv::Mat images(faces.size(), faceWidth * faceHeight, CV_8U);
+    for (size_t i = 0; i < faces.size(); i++) {
+        const cv::Mat& image = faces.image(i);
+        if (image.type() != CV_8UC1 || image.cols != faceWidth || image.rows != faceHeight)
+            throw std::runtime_error("[FaceDatabase]::write() : Invalid face image: " + faces.label(i));
+        faceLabels.at<boost::int32_t > (i, 0) = faces.labelId(i);
+        image.reshape(1, 1).copyTo(images.row(i));
+    }
+    cv::Mat modelLabels;
+    if (model) {
+        // map the label ids of the model to the table
+        const std::vector<std::string>& names = model->names();
+        std::vector<boost::int32_t> modelIds(names.size());
+        for (size_t i = 0; i < names.size(); i++) {
+            modelIds[i] = faces.find(names[i]);
+            if (modelIds[i] < 0) {
+                modelIds[i] = table.size();
+                table.push_back(names[i]);
+            }
+        }
+        const std::vector<int>& classes = model->classes();
+        modelLabels.create(classes.size(), 1, CV_32S);
+        for (size_t i = 0; i < classes.size(); i++)
+            modelLabels.at<boost::int32_t > (i, 0) = modelIds[classes[i]];
+        h.trainedFaces = classes.size();
+    }
+    h.labelCount = table.size();
+
+    std::string tmpName = fileName + ".tmp";
+    std::ofstream ofs(tmpName.c_str(), std::ios::binary | std::ios::trunc);
+    if (!ofs)
+        throw std::runtime_error("[FaceDatabase]::write() : Cannot open " + tmpName);
+    ofs.write((const char*) &h, sizeof (h));
+    h.labelsOffset = ofs.tellp();
+    for (size_t i = 0; i < table.size(); i++) {
+        boost::uint32_t length = table[i].size();
+        ofs.write((const char*) &length, sizeof (length));
+        ofs.write(table[i].data(), length);
+    }
+    writeMatrix(ofs, faceLabels, h.faceLabels);
+    writeMatrix(ofs, images, h.images);
+    if (model) {
+        writeMatrix(ofs, model->mean().reshape(1, 1), h.mean);
+        writeMatrix(ofs, model->eigenvalues(), h.eigenvalues);
+        writeMatrix(ofs, model->eigenvectors(), h.eigenvectors);
+        writeMatrix(ofs, model->projections(), h.projections);
+        writeMatrix(ofs, modelLabels, h.modelLabels);
+    }
+    pad(ofs);
+    // now that all offsets are known rewrite the header
+    ofs.seekp(0);
+    ofs.write((const char*) &h, sizeof (h));
+    ofs.close();
+    if (!ofs)
+        throw std::runtime_error("[FaceDatabase]::write() : Cannot write " + tmpName);
+    if (std::rename(tmpName.c_str(), fileName.c_str()) != 0) {
+        // rename does not replace existing files on every platform
+        std::remove(fileName.c_str());
+        if (std::rename(tmpName.c_str(), fileName.c_str()) != 0)
+            throw std::runtime_error("[FaceDatabase]::write() : Cannot replace " + fileName);
+    }
+}
+
+int FaceDatabase::faceWidth() const {
+    return header->faceWidth;
+}
+
+int FaceDatabase::faceHeight() const {
+    return header->faceHeight;
+}
+
+int FaceDatabase::numComponents() const {
+    return header->numComponents;
+}
+
+double FaceDatabase::threshold() const {
+    return header->threshold;
+}
+
+int FaceDatabase::trainedFaces() const {
+    return header->trainedFaces;
+}
+
+FaceStore FaceDatabase::faces() const {
+    FaceStore result;
+    cv::Mat ids = matrix(header->faceLabels);
+    cv::Mat images = matrix(header->images);
+    for (boost::uint32_t i = 0; i < header->faceCount; i++) {
+        boost::int32_t id = ids.at<boost::int32_t > (i, 0);
+        if (id < 0 || id >= (boost::int32_t) labels.size())
+            throw std::runtime_error("[FaceDatabase]::faces() : Invalid label index");
+        result.add(images.row(i).reshape(1, header->faceHeight), labels[id]);
+    }
+    return result;
+}
+
+Eigenfaces* FaceDatabase::model() const {
+    if (header->trainedFaces == 0)
+        return NULL;
+    cv::Mat ids = matrix(header->modelLabels);
+    cv::Mat projections = matrix(header->projections);
+    if (ids.rows != (int) header->trainedFaces || projections.rows != (int) header->trainedFaces)
+        throw std::runtime_error("[FaceDatabase]::model() : Invalid model");
+    std::vector<std::string> trained;
+    for (boost::uint32_t i = 0; i < header->trainedFaces; i++) {
+        boost::int32_t id = ids.at<boost::int32_t > (i, 0);
+        if (id < 0 || id >= (boost::int32_t) labels.size())
+            throw std::runtime_error("[FaceDatabase]::model() : Invalid label index");
+        trained.push_back(labels[id]);
+    }
+    Eigenfaces* eigenfaces = new Eigenfaces();
+    eigenfaces->load(matrix(header->mean),
+            matrix(header->eigenvalues),
+            matrix(header->eigenvectors),
+            projections,
+            trained);
+    return eigenfaces;
+}
+
+cv::Mat FaceDatabase::matrix(const Block& block) const {
+    if (block.rows == 0 || block.cols == 0)
+        return cv::Mat();
+    // the mapping is read-only, matrices must never be written to
+    uchar* data = static_cast<uchar*> (region.get_address()) + block.offset;
+    return cv::Mat(block.rows, block.cols, block.type, data);
+}
+
+void FaceDatabase::checkBlock(const Block& block) const {
+    if (block.rows == 0 || block.cols == 0)
+        return;
+    if (block.type != CV_8U && block.type != CV_32S && block.type != CV_32F && block.type != CV_64F)
+        throw std::runtime_error("[FaceDatabase] : Invalid block type");
+    size_t elemSize = block.type == CV_8U ? 1 : (block.type == CV_64F ? 8 : 4);
+    boost::uint64_t size = (boost::uint64_t) block.rows * block.cols * elemSize;
+    if (block.offset % ALIGNMENT != 0 || block.offset + size > region.get_size())
+        throw std::runtime_error("[FaceDatabase] : Invalid block");
+}
@@ -0,0 +1,132 @@
+/*
+ * Face recognition based on Eigenfaces for Urbi
+ * Copyright (C) 2012  Lukasz Malek
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * File:   facedatabase.hpp
+ */
+
+#ifndef FACEDATABASE_HPP
+#define	FACEDATABASE_HPP
+
+#include <string>
+#include <vector>
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include "opencv2/opencv.hpp"
+
+#include "eigenfaces.hpp"
+#include "facestore.hpp"
+
+/**
+ * Binary face database
+ *
+ * The file starts with a fixed size header followed by the label string
+ * table and the data blocks. Every block starts at a 64 byte boundary and
+ * holds a dense row-major matrix, so the file can be mapped read-only and
+ * cv::Mat headers can point straight into the mapping:
+ *
+ *   header | labels | faceLabels | images | mean | eigenvalues |
+ *   eigenvectors | projections | modelLabels
+ *
+ * Multi byte values use the byte order of the machine that wrote the file,
+ * files written on a machine with a different byte order are rejected.
+ */
+class FaceDatabase {
+public:
+    static const int ALIGNMENT = 64;
+    static const boost::uint32_t VERSION = 1;
+
+    /**
+     * Maps fileName read-only
+     * Throws std::runtime_error if the file is not a valid database.
+     * All matrices returned by this object point into the mapping and are
+     * valid as long as the object lives.
+     */
+    explicit FaceDatabase(const std::string& fileName);
+
+    //! checks if fileName starts with the binary database signature
+    static bool isDatabase(const std::string& fileName);
+
+    /**
+     * Writes the database to fileName
+     * The file is written next to the target and renamed, so a database
+     * that is currently mapped stays valid. model may be NULL.
+     */
+    static void write(const std::string& fileName,
+            int faceWidth,
+            int faceHeight,
+            int numComponents,
+            double threshold,
+            const FaceStore& faces,
+            const Eigenfaces* model);
+
+    int faceWidth() const;
+    int faceHeight() const;
+    int numComponents() const;
+    double threshold() const;
+
+    //! faces stored in the database, images point into the mapping
+    FaceStore faces() const;
+
+    //! number of faces the stored model was computed from, 0 if none
+    int trainedFaces() const;
+
+    //! restores the stored model, returns NULL if there is none
+    Eigenfaces* model() const;
+
+private:
+    struct Block {
+        boost::uint64_t offset;
+        boost::uint32_t rows;
+        boost::uint32_t cols;
+        boost::int32_t type;
+        boost::uint32_t reserved;
+    };
+
+    struct Header {
+        char magic[8];
+        boost::uint32_t byteOrder;
+        boost::uint32_t version;
+        boost::int32_t faceWidth;
+        boost::int32_t faceHeight;
+        boost::int32_t numComponents;
+        boost::uint32_t faceCount;
+        boost::uint32_t labelCount;
+        boost::uint32_t trainedFaces;
+        double threshold;
+        boost::uint64_t labelsOffset;
+        Block faceLabels;
+        Block images;
+        Block mean;
+        Block eigenvalues;
+        Block eigenvectors;
+        Block projections;
+        Block modelLabels;
+    };
+
+    cv::Mat matrix(const Block& block) const;
+    void checkBlock(const Block& block) const;
+
+    boost::interprocess::file_mapping file;
+    boost::interprocess::mapped_region region;
+    const Header* header;
+    std::vector<std::string> labels;
+};
+
+#endif	/* FACEDATABASE_HPP */
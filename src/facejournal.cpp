@@ -0,0 +1,250 @@
+/*
+ * Face recognition based on Eigenfaces for Urbi
+ * Copyright (C) 2012  Lukasz Malek
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * File:   facejournal.cpp
+ */
+
+
+#include "facejournal.hpp"
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <boost/crc.hpp>
+#include <boost/filesystem.hpp>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace {
+
+    const char MAGIC[8] = {'U', 'E', 'I', 'G', 'J', 'N', 'L', '\0'};
+    const boost::uint32_t BYTE_ORDER_MARK = 0x01020304;
+    // records larger than this are taken for damage, not for faces
+    const boost::uint32_t MAX_LABEL_LENGTH = 1 << 16;
+    const boost::int64_t MAX_PIXELS = 1 << 26;
+
+    template<typename Record>
+    boost::uint32_t recordCrc(const Record& record, const std::string& label, const cv::Mat& image) {
+        boost::crc_32_type crc;
+        crc.process_bytes(&record.labelLength, sizeof (record.labelLength));
+        crc.process_bytes(&record.rows, sizeof (record.rows));
+        crc.process_bytes(&record.cols, sizeof (record.cols));
+        crc.process_bytes(label.data(), label.size());
+        for (int i = 0; i < image.rows; i++)
+            crc.process_bytes(image.ptr(i), image.cols);
+        return crc.checksum();
+    }
+
+    //! reads the next record, returns false at the end or at a damaged record
+    template<typename Record>
+    bool readRecord(std::istream& is, Record& record, std::string& label, cv::Mat& image) {
+        if (!is.read((char*) &record, sizeof (record)))
+            return false;
+        if (record.labelLength > MAX_LABEL_LENGTH || record.rows <= 0 || record.cols <= 0
+                || (boost::int64_t) record.rows * record.cols > MAX_PIXELS)
+            return false;
+        label.resize(record.labelLength);
+        if (record.labelLength > 0 && !is.read(&label[0], record.labelLength))
+            return false;
+        image.create(record.rows, record.cols, CV_8UC1);
+        if (!is.read((char*) image.data, image.total()))
+            return false;
+        return recordCrc(record, label, image) == record.crc;
+    }
+
+} // namespace
+
+FaceJournal::FaceJournal(const std::string& fileName, boost::uint32_t baseFaces) :
+    fileName(fileName),
+    file(NULL),
+    recordCount(0),
+    validSize(0),
+    validRecords(0),
+    damaged(false) {
+    std::ifstream ifs(fileName.c_str(), std::ios::binary);
+    if (ifs && ifs.read((char*) &header, sizeof (header))) {
+        if (memcmp(header.magic, MAGIC, sizeof (MAGIC)) != 0)
+            throw std::runtime_error("[FaceJournal] : Not a face journal: " + fileName);
+        if (header.byteOrder != BYTE_ORDER_MARK)
+            throw std::runtime_error("[FaceJournal] : Unsupported byte order: " + fileName);
+        if (header.version != VERSION)
+            throw std::runtime_error("[FaceJournal] : Unsupported version: " + fileName);
+        // count the intact records, a torn one at the end is cut off below
+        Record record;
+        std::string label;
+        cv::Mat image;
+        validSize = sizeof (header);
+        while (readRecord(ifs, record, label, image)) {
+            validSize = ifs.tellg();
+            recordCount++;
+        }
+    }
+    ifs.close();
+    if (validSize == 0) {
+        memset(&header, 0, sizeof (header));
+        memcpy(header.magic, MAGIC, sizeof (MAGIC));
+        header.byteOrder = BYTE_ORDER_MARK;
+        header.version = VERSION;
+        header.baseFaces = baseFaces;
+        file = std::fopen(fileName.c_str(), "wb");
+        if (!file || std::fwrite(&header, sizeof (header), 1, file) != 1) {
+            if (file)
+                std::fclose(file);
+            throw std::runtime_error("[FaceJournal] : Cannot create " + fileName);
+        }
+        sync();
+        validSize = sizeof (header);
+        return;
+    }
+    validRecords = recordCount;
+    if (boost::filesystem::file_size(fileName) > validSize)
+        boost::filesystem::resize_file(fileName, validSize);
+    file = std::fopen(fileName.c_str(), "ab");
+    if (!file)
+        throw std::runtime_error("[FaceJournal] : Cannot open " + fileName);
+}
+
+FaceJournal::~FaceJournal() {
+    if (file)
+        std::fclose(file);
+}
+
+void FaceJournal::append(const cv::Mat& image, const std::string& label) {
+    if (damaged)
+        throw std::runtime_error("[FaceJournal]::append() : Damaged journal, compact it: " + fileName);
+    try {
+        boost::uint64_t size = writeRecord(image, label);
+        sync();
+        validSize += size;
+        validRecords = recordCount;
+    } catch (const std::exception&) {
+        rollback();
+        throw;
+    }
+}
+
+void FaceJournal::append(const FaceStore& faces, size_t begin, size_t end) {
+    if (damaged)
+        throw std::runtime_error("[FaceJournal]::append() : Damaged journal, compact it: " + fileName);
+    try {
+        boost::uint64_t size = 0;
+        for (size_t i = begin; i < end; i++)
+            size += writeRecord(faces.image(i), faces.label(i));
+        sync();
+        validSize += size;
+        validRecords = recordCount;
+    } catch (const std::exception&) {
+        rollback();
+        throw;
+    }
+}
+
+boost::uint32_t FaceJournal::baseFaces() const {
+    return header.baseFaces;
+}
+
+size_t FaceJournal::records() const {
+    return recordCount;
+}
+
+void FaceJournal::write(const std::string& fileName, boost::uint32_t baseFaces, const FaceStore& faces) {
+    std::string tmpName = fileName + ".tmp";
+    std::remove(tmpName.c_str());
+    {
+        FaceJournal journal(tmpName, baseFaces);
+        journal.append(faces, baseFaces, faces.size());
+    }
+    if (std::rename(tmpName.c_str(), fileName.c_str()) != 0) {
+        // rename does not replace existing files on every platform
+        std::remove(fileName.c_str());
+        if (std::rename(tmpName.c_str(), fileName.c_str()) != 0)
+            throw std::runtime_error("[FaceJournal]::write() : Cannot replace " + fileName);
+    }
+}
+
+size_t FaceJournal::replay(const std::string& fileName, FaceStore& faces) {
+    std::ifstream ifs(fileName.c_str(), std::ios::binary);
+    Header header;
+    if (!ifs || !ifs.read((char*) &header, sizeof (header)))
+        return 0;
+    if (memcmp(header.magic, MAGIC, sizeof (MAGIC)) != 0 || header.byteOrder != BYTE_ORDER_MARK
+            || header.version != VERSION)
+        throw std::runtime_error("[FaceJournal]::replay() : Invalid journal: " + fileName);
+    if (faces.size() < header.baseFaces)
+        throw std::runtime_error("[FaceJournal]::replay() : Journal of a larger database: " + fileName);
+    // the records up to the size of faces were folded into the snapshot
+    size_t skip = faces.size() - header.baseFaces;
+    size_t added = 0;
+    Record record;
+    std::string label;
+    cv::Mat image;
+    for (size_t i = 0; readRecord(ifs, record, label, image); i++) {
+        if (i < skip)
+            continue;
+        faces.add(image, label);
+        // the next record must not overwrite the image kept by faces
+        image.release();
+        added++;
+    }
+    return added;
+}
+
+boost::uint64_t FaceJournal::writeRecord(const cv::Mat& image, const std::string& label) {
+    if (image.type() != CV_8UC1)
+        throw std::runtime_error("[FaceJournal]::append() : Invalid face image: " + label);
+    Record record;
+    record.labelLength = label.size();
+    record.rows = image.rows;
+    record.cols = image.cols;
+    record.crc = recordCrc(record, label, image);
+    bool written = std::fwrite(&record, sizeof (record), 1, file) == 1
+            && std::fwrite(label.data(), 1, label.size(), file) == label.size();
+    for (int i = 0; written && i < image.rows; i++)
+        written = std::fwrite(image.ptr(i), 1, image.cols, file) == (size_t) image.cols;
+    if (!written)
+        throw std::runtime_error("[FaceJournal]::append() : Cannot write " + fileName);
+    recordCount++;
+    return sizeof (record) + label.size() + image.total();
+}
+
+void FaceJournal::sync() {
+    // the record must be on disk before train() returns
+    if (std::fflush(file) != 0)
+        throw std::runtime_error("[FaceJournal] : Cannot write " + fileName);
+#ifdef _WIN32
+    _commit(_fileno(file));
+#else
+    fsync(fileno(file));
+#endif
+}
+
+void FaceJournal::rollback() {
+    // records appended after a torn one would be lost by the replay
+    std::fclose(file);
+    file = NULL;
+    recordCount = validRecords;
+    try {
+        boost::filesystem::resize_file(fileName, validSize);
+        file = std::fopen(fileName.c_str(), "ab");
+    } catch (const boost::filesystem::filesystem_error&) {
+    }
+    if (!file)
+        damaged = true;
+}
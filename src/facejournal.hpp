@@ -0,0 +1,126 @@
+/*
+ * Face recognition based on Eigenfaces for Urbi
+ * Copyright (C) 2012  Lukasz Malek
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * File:   facejournal.hpp
+ */
+
+
+#ifndef FACEJOURNAL_HPP
+#define	FACEJOURNAL_HPP
+
+#include <cstdio>
+#include <string>
+#include <boost/cstdint.hpp>
+
+#include "opencv2/opencv.hpp"
+
+#include "facestore.hpp"
+
+/**
+ * Append-only journal of trained faces
+ *
+ * The journal extends a snapshot (a saved database) by the faces trained
+ * after it was written. It starts with a header holding the number of
+ * faces of the snapshot it extends, followed by one record per face:
+ *
+ *   label length | rows | cols | crc32 | label | pixels
+ *
+ * The crc covers the sizes, the label and the pixels. Every append is
+ * flushed to disk, so training a face costs one record and not a rewrite
+ * of the database. A record torn by a crash is detected by its crc and
+ * cut off when the journal is opened again. A failed append is cut off
+ * right away, so later records never follow a torn one; if that fails too
+ * the journal refuses appends until it is replaced.
+ */
+class FaceJournal {
+public:
+    static const boost::uint32_t VERSION = 1;
+
+    /**
+     * Opens fileName for appending
+     * The journal is created for a snapshot of baseFaces faces if it does
+     * not exist. Throws std::runtime_error if it cannot be opened.
+     */
+    FaceJournal(const std::string& fileName, boost::uint32_t baseFaces);
+    ~FaceJournal();
+
+    /**
+     * Appends a CV_8UC1 image and flushes it to disk
+     * Throws std::runtime_error if it cannot be written, the journal then
+     * ends with the previous record.
+     */
+    void append(const cv::Mat& image, const std::string& label);
+    //! appends the images begin..end of faces and flushes them once, all or none
+    void append(const FaceStore& faces, size_t begin, size_t end);
+
+    //! number of faces of the snapshot the journal extends
+    boost::uint32_t baseFaces() const;
+    //! number of records in the journal
+    size_t records() const;
+
+    /**
+     * Writes a new journal extending a snapshot of baseFaces faces
+     * It holds the images of faces from baseFaces on. The file is written
+     * next to the target and renamed, an existing journal is replaced.
+     */
+    static void write(const std::string& fileName, boost::uint32_t baseFaces, const FaceStore& faces);
+
+    /**
+     * Adds the faces of the journal fileName that faces does not hold yet
+     * faces must hold the snapshot the journal extends, the records
+     * before faces.size() are skipped. Replay stops at the first damaged
+     * record. Returns the number of faces added, 0 if there is no journal.
+     */
+    static size_t replay(const std::string& fileName, FaceStore& faces);
+
+private:
+    struct Header {
+        char magic[8];
+        boost::uint32_t byteOrder;
+        boost::uint32_t version;
+        boost::uint32_t baseFaces;
+        boost::uint32_t reserved;
+    };
+
+    struct Record {
+        boost::uint32_t labelLength;
+        boost::int32_t rows;
+        boost::int32_t cols;
+        boost::uint32_t crc;
+    };
+
+    //! writes a record, returns its size in bytes
+    boost::uint64_t writeRecord(const cv::Mat& image, const std::string& label);
+    void sync();
+    //! cuts the journal back to the last intact record after a failed append
+    void rollback();
+
+    FaceJournal(const FaceJournal&);
+    FaceJournal& operator=(const FaceJournal&);
+
+    std::string fileName;
+    std::FILE* file;
+    Header header;
+    size_t recordCount;
+    // end of the last record flushed to disk, and the count up to it
+    boost::uint64_t validSize;
+    size_t validRecords;
+    // set when a failed append could not be cut off
+    bool damaged;
+};
+
+#endif	/* FACEJOURNAL_HPP */
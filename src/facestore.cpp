@@ -0,0 +1,89 @@
+/*
+ * Face recognition based on Eigenfaces for Urbi
+ * Copyright (C) 2012  Lukasz Malek
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * File:   facestore.cpp
+ */
+
+#include "facestore.hpp"
+#include <stdexcept>
+
+int FaceStore::add(const cv::Mat& image, const std::string& label) {
+    std::map<std::string, int>::iterator it = labelIds.find(label);
+    if (it == labelIds.end()) {
+        it = labelIds.insert(std::make_pair(label, (int) labelNames.size())).first;
+        labelNames.push_back(label);
+        labelImages.push_back(std::vector<int>());
+    }
+    int index = imageList.size();
+    imageList.push_back(image);
+    imageLabels.push_back(it->second);
+    labelImages[it->second].push_back(index);
+    return index;
+}
+
+void FaceStore::reserve(size_t count) {
+    imageList.reserve(count);
+    imageLabels.reserve(count);
+}
+
+void FaceStore::assign(const std::vector<FacePair>& faces) {
+    clear();
+    reserve(faces.size());
+    for (size_t i = 0; i < faces.size(); i++)
+        add(faces[i].first, faces[i].second);
+}
+
+void FaceStore::clear() {
+    imageList.clear();
+    imageLabels.clear();
+    labelNames.clear();
+    labelIds.clear();
+    labelImages.clear();
+}
+
+int FaceStore::find(const std::string& label) const {
+    std::map<std::string, int>::const_iterator it = labelIds.find(label);
+    return it == labelIds.end() ? -1 : it->second;
+}
+
+const std::vector<int>& FaceStore::imagesOf(int id) const {
+    if (id < 0 || id >= (int) labelImages.size())
+        throw std::runtime_error("[FaceStore]::imagesOf() : Invalid label id");
+    return labelImages[id];
+}
+
+std::vector<std::string> FaceStore::sortedNames() const {
+    std::vector<std::string> result;
+    result.reserve(labelIds.size());
+    for (std::map<std::string, int>::const_iterator it = labelIds.begin(); it != labelIds.end(); ++it)
+        result.push_back(it->first);
+    return result;
+}
+
+std::vector<std::string> FaceStore::labels() const {
+    std::vector<std::string> result(imageLabels.size());
+    for (size_t i = 0; i < imageLabels.size(); i++)
+        result[i] = labelNames[imageLabels[i]];
+    return result;
+}
+
+std::vector<FacePair> FaceStore::pairs() const {
+    std::vector<FacePair> result(imageList.size());
+    for (size_t i = 0; i < imageList.size(); i++)
+        result[i] = std::make_pair(imageList[i], labelNames[imageLabels[i]]);
+    return result;
+}
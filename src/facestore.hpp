@@ -0,0 +1,100 @@
+/*
+ * Face recognition based on Eigenfaces for Urbi
+ * Copyright (C) 2012  Lukasz Malek
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * File:   facestore.hpp
+ */
+
+#ifndef FACESTORE_HPP
+#define	FACESTORE_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "opencv2/opencv.hpp"
+
+typedef std::pair<cv::Mat, std::string> FacePair;
+
+/**
+ * Training images indexed by label
+ *
+ * Every label is stored once and referred to by its id, the ids are given
+ * in order of appearance. The images of every label are kept in training
+ * order, so the label queries do not have to scan all images. Images are
+ * only ever appended, an index stays valid until clear() or assign().
+ */
+class FaceStore {
+public:
+    //! appends an image and returns its index
+    int add(const cv::Mat& image, const std::string& label);
+    //! makes room for count images in total
+    void reserve(size_t count);
+    //! replaces all images
+    void assign(const std::vector<FacePair>& faces);
+    void clear();
+
+    size_t size() const {
+        return imageList.size();
+    }
+
+    const cv::Mat& image(size_t index) const {
+        return imageList[index];
+    }
+
+    int labelId(size_t index) const {
+        return imageLabels[index];
+    }
+
+    const std::string& label(size_t index) const {
+        return labelNames[imageLabels[index]];
+    }
+
+    //! returns the number of distinct labels
+    int labelCount() const {
+        return labelNames.size();
+    }
+
+    //! returns the label of every label id
+    const std::vector<std::string>& names() const {
+        return labelNames;
+    }
+
+    //! returns the id of label, -1 if it has no images
+    int find(const std::string& label) const;
+    //! returns the indices of the images of a label id
+    const std::vector<int>& imagesOf(int id) const;
+    //! returns the labels in alphabetical order
+    std::vector<std::string> sortedNames() const;
+
+    const std::vector<cv::Mat>& images() const {
+        return imageList;
+    }
+
+    //! returns the label of every image
+    std::vector<std::string> labels() const;
+    //! returns (image, label) pairs, the format of the XML archive
+    std::vector<FacePair> pairs() const;
+
+private:
+    std::vector<cv::Mat> imageList;
+    std::vector<int> imageLabels;
+    std::vector<std::string> labelNames;
+    std::map<std::string, int> labelIds;
+    std::vector<std::vector<int> > labelImages;
+};
+
+#endif	/* FACESTORE_HPP */
@@ -104,6 +104,22 @@ Mat cv::asRowMatrix(const vector<Mat>& src, int type) {
 	return data;
 }
 
+Mat cv::allocAligned(int rows, int cols, int type) {
+	// pad the rows to a multiple of 64 bytes and skip to the first boundary
+	int elemSize = CV_ELEM_SIZE(type);
+	int step = (int) alignSize(cols * elemSize, 64) + 64;
+	Mat buffer(std::max(rows, 1), step / elemSize, type);
+	int offset = (int) (alignPtr(buffer.data, 64) - buffer.data) / elemSize;
+	return buffer.rowRange(0, rows).colRange(offset, offset + cols);
+}
+
+bool cv::reserveMat(Mat& m, int rows, int cols, int type) {
+	if (m.rows == rows && m.cols == cols && m.type() == type)
+		return false;
+	m.create(rows, cols, type);
+	return true;
+}
+
 Mat cv::transpose(const Mat& src) {
 		Mat dst;
 		transpose(src, dst);
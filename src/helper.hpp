@@ -49,6 +49,10 @@ Mat sortMatrixByRow(const Mat& src, vector<int> sorted_indices);
 Mat asRowMatrix(const vector<Mat>& src, int type = CV_32FC1);
 //! turns a vector of matrices into a column matrix
 Mat asColumnMatrix(const vector<Mat>& src, int type = CV_32FC1);
+//! allocates a matrix whose rows start at 64 byte boundaries
+Mat allocAligned(int rows, int cols, int type = CV_32FC1);
+//! creates m unless it already has this size and type, returns true if it allocated
+bool reserveMat(Mat& m, int rows, int cols, int type);
 //! turns a one-channel matrix into a grayscale representation
 Mat toGrayscale(const Mat& src);
 //! transposes a matrix
@@ -0,0 +1,120 @@
+/*
+ * Face recognition based on Eigenfaces for Urbi
+ * Copyright (C) 2012  Lukasz Malek
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * File:   ivfindex.cpp
+ */
+
+#include "ivfindex.hpp"
+#include "distance.hpp"
+#include "helper.hpp"
+#include <algorithm>
+#include <limits>
+
+// k-means is trained on at most this many rows per list
+static const int TRAINING_ROWS_PER_LIST = 64;
+
+void IVFIndex::build(const Mat& data, int nlist) {
+    clear();
+    int n = data.rows;
+    int k = data.cols;
+    if (n == 0 || nlist <= 0)
+        return;
+    nlist = std::min(nlist, n);
+    // train the coarse quantizer on a random subset of the rows
+    int trainRows = std::min(n, nlist * TRAINING_ROWS_PER_LIST);
+    vector<int> order(n);
+    for (int i = 0; i < n; i++)
+        order[i] = i;
+    RNG rng;
+    for (int i = 0; i < trainRows; i++)
+        std::swap(order[i], order[i + rng((unsigned) (n - i))]);
+    Mat training(trainRows, k, CV_32F);
+    for (int i = 0; i < trainRows; i++)
+        data.row(order[i]).copyTo(training.row(i));
+    Mat bestLabels, centers;
+    kmeans(training, nlist, bestLabels,
+            TermCriteria(TermCriteria::COUNT + TermCriteria::EPS, 20, 1e-3),
+            1, KMEANS_PP_CENTERS, centers);
+    _centroids = allocAligned(nlist, k, CV_32F);
+    centers.copyTo(_centroids);
+    _centroidNorms.resize(nlist);
+    for (int list = 0; list < nlist; list++) {
+        const float* c = _centroids.ptr<float>(list);
+        _centroidNorms[list] = dot32f(c, c, k);
+    }
+    // assign every row to its nearest centroid
+    vector<int> assignment(n);
+    _offsets.assign(nlist + 1, 0);
+    for (int i = 0; i < n; i++) {
+        float d;
+        assignment[i] = nearest32f(data.ptr<float>(i), _centroids.ptr<float>(), _centroids.step,
+                &_centroidNorms[0], nlist, k, d);
+        _offsets[assignment[i] + 1]++;
+    }
+    for (int list = 0; list < nlist; list++)
+        _offsets[list + 1] += _offsets[list];
+    // copy the rows list by list so that a list is scanned sequentially
+    vector<int> next(_offsets.begin(), _offsets.end() - 1);
+    _vectors = allocAligned(n, k, CV_32F);
+    _norms.resize(n);
+    _ids.resize(n);
+    for (int i = 0; i < n; i++) {
+        int row = next[assignment[i]]++;
+        data.row(i).copyTo(_vectors.row(row));
+        const float* v = _vectors.ptr<float>(row);
+        _norms[row] = dot32f(v, v, k);
+        _ids[row] = i;
+    }
+}
+
+void IVFIndex::clear() {
+    _centroids.release();
+    _centroidNorms.clear();
+    _vectors.release();
+    _norms.clear();
+    _ids.clear();
+    _offsets.clear();
+}
+
+int IVFIndex::search(const float* q, int nprobe, float& minDist, vector<std::pair<float, int> >& ranking) const {
+    int nlist = _centroids.rows;
+    int k = _centroids.cols;
+    minDist = std::numeric_limits<float>::max();
+    if (empty())
+        return -1;
+    nprobe = std::max(1, std::min(nprobe, nlist));
+    // rank the lists by the distance of their centroids, ||q||^2 is omitted
+    ranking.resize(nlist);
+    for (int list = 0; list < nlist; list++)
+        ranking[list] = std::make_pair(_centroidNorms[list] - 2 * dot32f(q, _centroids.ptr<float>(list), k), list);
+    std::partial_sort(ranking.begin(), ranking.begin() + nprobe, ranking.end());
+    int minIdx = -1;
+    for (int probe = 0; probe < nprobe; probe++) {
+        int list = ranking[probe].second;
+        int begin = _offsets[list];
+        int rows = _offsets[list + 1] - begin;
+        if (rows == 0)
+            continue;
+        float d;
+        int i = nearest32f(q, _vectors.ptr<float>(begin), _vectors.step, &_norms[begin], rows, k, d);
+        if (d < minDist) {
+            minDist = d;
+            minIdx = _ids[begin + i];
+        }
+    }
+    return minIdx;
+}
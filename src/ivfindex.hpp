@@ -0,0 +1,60 @@
+/*
+ * Face recognition based on Eigenfaces for Urbi
+ * Copyright (C) 2012  Lukasz Malek
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * File:   ivfindex.hpp
+ */
+
+#ifndef IVFINDEX_HPP_
+#define IVFINDEX_HPP_
+
+#include "opencv2/opencv.hpp"
+#include <vector>
+
+using namespace std;
+using namespace cv;
+
+/*
+ * Inverted file index for approximate nearest neighbour search
+ *
+ * The rows are clustered with k-means and every row is stored in the list
+ * of its nearest centroid. A search ranks the centroids and scans only the
+ * rows of the nprobe closest lists, nprobe trades recall for speed.
+ */
+class IVFIndex {
+private:
+	Mat _centroids; // one centroid per row
+	vector<float> _centroidNorms;
+	Mat _vectors; // rows grouped by list, 64 byte aligned
+	vector<float> _norms;
+	vector<int> _ids; // row of the indexed data for each row of _vectors
+	vector<int> _offsets; // first row of each list in _vectors, plus the end
+
+public:
+	IVFIndex() {};
+	//! clusters the CV_32F rows of data into nlist lists
+	void build(const Mat& data, int nlist);
+	//! forgets the indexed data
+	void clear();
+	//! returns true if nothing is indexed
+	bool empty() const { return _vectors.empty(); }
+	//! returns the number of lists
+	int lists() const { return _centroids.rows; }
+	//! finds the nearest indexed row in the nprobe closest lists, ranking them in ranking
+	int search(const float* q, int nprobe, float& minDist, vector<std::pair<float, int> >& ranking) const;
+};
+
+#endif /* IVFINDEX_HPP_ */
@@ -0,0 +1,124 @@
+/*
+ * Face recognition based on Eigenfaces for Urbi
+ * Copyright (C) 2012  Lukasz Malek
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * File:   preprocessor.cpp
+ */
+
+#include "preprocessor.hpp"
+#include "helper.hpp"
+#include <cmath>
+#include <stdexcept>
+
+namespace {
+
+    //! source positions and weights of cv::resize with INTER_LINEAR
+    void linearTable(int srcLength, int dstLength, vector<int>& ofs, vector<float>& alpha) {
+        double scale = (double) srcLength / dstLength;
+        ofs.resize(dstLength);
+        alpha.resize(dstLength);
+        for (int i = 0; i < dstLength; i++) {
+            float f = (float) ((i + 0.5) * scale - 0.5);
+            int s = (int) std::floor(f);
+            f -= s;
+            if (s < 0) {
+                s = 0;
+                f = 0;
+            }
+            if (s >= srcLength - 1) {
+                s = srcLength - 1;
+                f = 0;
+            }
+            ofs[i] = s;
+            alpha[i] = f;
+        }
+    }
+
+    //! grey level of the pixel at p
+    template<int channels>
+    inline float grey(const uchar* p) {
+        if (channels == 1)
+            return p[0];
+        return 0.299f * p[0] + 0.587f * p[1] + 0.114f * p[2];
+    }
+
+    template<int channels, typename T>
+    void resample(const uchar* data, size_t step,
+            const vector<int>& xofs, const vector<float>& xalpha,
+            const vector<int>& yofs, const vector<float>& yalpha,
+            const T* mean, T* dst) {
+        int width = xofs.size();
+        int height = yofs.size();
+        for (int y = 0; y < height; y++) {
+            const uchar* row0 = data + yofs[y] * step;
+            // the last source row is clamped and has no successor
+            const uchar* row1 = yalpha[y] > 0 ? row0 + step : row0;
+            float wy = yalpha[y];
+            for (int x = 0; x < width; x++) {
+                int x0 = xofs[x] * channels;
+                int x1 = xalpha[x] > 0 ? x0 + channels : x0;
+                float wx = xalpha[x];
+                float top = grey<channels>(row0 + x0) * (1 - wx) + grey<channels>(row0 + x1) * wx;
+                float bottom = grey<channels>(row1 + x0) * (1 - wx) + grey<channels>(row1 + x1) * wx;
+                *dst = (T) (top * (1 - wy) + bottom * wy) - *mean;
+                dst++;
+                mean++;
+            }
+        }
+    }
+
+    template<typename T>
+    void resample(const uchar* data, int channels, size_t step,
+            const vector<int>& xofs, const vector<float>& xalpha,
+            const vector<int>& yofs, const vector<float>& yalpha,
+            const T* mean, T* dst) {
+        if (channels == 1)
+            resample<1>(data, step, xofs, xalpha, yofs, yalpha, mean, dst);
+        else
+            resample<3>(data, step, xofs, xalpha, yofs, yalpha, mean, dst);
+    }
+
+} // namespace
+
+void FacePreprocessor::apply(const uchar* data, int width, int height, int channels, size_t step,
+        Size size, const Mat& mean, Mat& dst) {
+    if (channels != 1 && channels != 3)
+        throw std::runtime_error("[FacePreprocessor]::apply() : Unsupported number of channels");
+    if ((int) mean.total() != size.area() || !mean.isContinuous()
+            || (mean.type() != CV_32FC1 && mean.type() != CV_64FC1))
+        throw std::runtime_error("[FacePreprocessor]::apply() : Mean does not match the face size");
+    if (width <= 0 || height <= 0)
+        throw std::runtime_error("[FacePreprocessor]::apply() : Empty image");
+    if (Size(width, height) != _srcSize || size != _dstSize)
+        setGeometry(Size(width, height), size);
+    if (reserveMat(dst, 1, size.area(), mean.type()))
+        _allocations++;
+    if (mean.depth() == CV_32F)
+        resample(data, channels, step, _xofs, _xalpha, _yofs, _yalpha,
+                mean.ptr<float>(), dst.ptr<float>());
+    else
+        resample(data, channels, step, _xofs, _xalpha, _yofs, _yalpha,
+                mean.ptr<double>(), dst.ptr<double>());
+}
+
+void FacePreprocessor::setGeometry(Size src, Size dst) {
+    if ((int) _xofs.capacity() < dst.width || (int) _yofs.capacity() < dst.height)
+        _allocations++;
+    linearTable(src.width, dst.width, _xofs, _xalpha);
+    linearTable(src.height, dst.height, _yofs, _yalpha);
+    _srcSize = src;
+    _dstSize = dst;
+}
@@ -0,0 +1,68 @@
+/*
+ * Face recognition based on Eigenfaces for Urbi
+ * Copyright (C) 2012  Lukasz Malek
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * File:   preprocessor.hpp
+ */
+
+#ifndef PREPROCESSOR_HPP_
+#define PREPROCESSOR_HPP_
+
+#include "opencv2/opencv.hpp"
+#include <vector>
+
+using namespace std;
+using namespace cv;
+
+/*
+ * Fused preprocessing of camera images
+ *
+ * Converts a grey or RGB image to grey, resizes it bilinearly like
+ * cv::resize, converts it to the type of the mean and subtracts the mean,
+ * all in a single pass over the output. Intermediate values are not rounded
+ * to 8 bits, so the result differs from cvtColor + resize by less than one
+ * grey level. The interpolation tables are kept between calls and only
+ * rebuilt when the image or face size changes.
+ */
+class FacePreprocessor {
+private:
+	Size _srcSize;
+	Size _dstSize;
+	vector<int> _xofs; // first source column of each output column
+	vector<float> _xalpha; // weight of the second source column
+	vector<int> _yofs;
+	vector<float> _yalpha;
+	unsigned _allocations;
+
+public:
+	FacePreprocessor() : _allocations(0) {};
+	/**
+	 * Centers a face for Eigenfaces::predictCentered
+	 * data holds height rows of width pixels with channels (1 or 3, RGB)
+	 * bytes each, step bytes apart. The resized face minus mean (CV_32F or
+	 * CV_64F, size.area() elements) is stored in dst as a single row.
+	 */
+	void apply(const uchar* data, int width, int height, int channels, size_t step,
+			Size size, const Mat& mean, Mat& dst);
+	//! returns how often apply() had to allocate
+	unsigned allocations() const { return _allocations; }
+
+private:
+	//! rebuilds the interpolation tables for a new geometry
+	void setGeometry(Size src, Size dst);
+};
+
+#endif /* PREPROCESSOR_HPP_ */
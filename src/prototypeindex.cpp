@@ -0,0 +1,145 @@
+/*
+ * Face recognition based on Eigenfaces for Urbi
+ * Copyright (C) 2012  Lukasz Malek
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * File:   prototypeindex.cpp
+ */
+
+#include "prototypeindex.hpp"
+#include "distance.hpp"
+#include "helper.hpp"
+#include <algorithm>
+#include <limits>
+
+void PrototypeIndex::build(const Mat& data, const vector<int>& classes, int classCount,
+        int perClass, Method method) {
+    clear();
+    int n = data.rows;
+    int k = data.cols;
+    if (n == 0 || perClass <= 0)
+        return;
+    vector<vector<int> > members(classCount);
+    for (int i = 0; i < n; i++)
+        members[classes[i]].push_back(i);
+    vector<Mat> prototypes;
+    for (int classIdx = 0; classIdx < classCount; classIdx++) {
+        const vector<int>& rows = members[classIdx];
+        int count = rows.size();
+        if (count <= perClass) {
+            // few rows, every row is its own prototype
+            for (int i = 0; i < count; i++) {
+                prototypes.push_back(data.row(rows[i]));
+                _classes.push_back(classIdx);
+                _rows.push_back(rows[i]);
+            }
+            continue;
+        }
+        Mat samples(count, k, CV_32F);
+        for (int i = 0; i < count; i++)
+            data.row(rows[i]).copyTo(samples.row(i));
+        Mat assignment, centers;
+        kmeans(samples, perClass, assignment,
+                TermCriteria(TermCriteria::COUNT + TermCriteria::EPS, 20, 1e-3),
+                1, KMEANS_PP_CENTERS, centers);
+        // the member nearest to each centre represents its cluster
+        vector<float> bestDist(perClass, std::numeric_limits<float>::max());
+        vector<int> bestRow(perClass, -1);
+        for (int i = 0; i < count; i++) {
+            int cluster = assignment.at<int>(i);
+            float d = l2sqr32f(samples.ptr<float>(i), centers.ptr<float>(cluster), k);
+            if (d < bestDist[cluster]) {
+                bestDist[cluster] = d;
+                bestRow[cluster] = i;
+            }
+        }
+        for (int cluster = 0; cluster < perClass; cluster++) {
+            if (bestRow[cluster] < 0)
+                continue;
+            prototypes.push_back(method == MEDOIDS ? samples.row(bestRow[cluster]) : centers.row(cluster));
+            _classes.push_back(classIdx);
+            _rows.push_back(rows[bestRow[cluster]]);
+        }
+    }
+    _memberOffsets.assign(1, 0);
+    for (int classIdx = 0; classIdx < classCount; classIdx++) {
+        _members.insert(_members.end(), members[classIdx].begin(), members[classIdx].end());
+        _memberOffsets.push_back(_members.size());
+    }
+    int m = prototypes.size();
+    _prototypes = allocAligned(m, k, CV_32F);
+    _norms.resize(m);
+    for (int i = 0; i < m; i++) {
+        prototypes[i].copyTo(_prototypes.row(i));
+        const float* p = _prototypes.ptr<float>(i);
+        _norms[i] = dot32f(p, p, k);
+    }
+}
+
+void PrototypeIndex::clear() {
+    _prototypes.release();
+    _norms.clear();
+    _classes.clear();
+    _rows.clear();
+    _members.clear();
+    _memberOffsets.clear();
+}
+
+int PrototypeIndex::search(const float* q, float& minDist, float& otherDist) const {
+    minDist = otherDist = std::numeric_limits<float>::max();
+    if (empty())
+        return -1;
+    int k = _prototypes.cols;
+    // ||q||^2 is omitted while scanning
+    float best = std::numeric_limits<float>::max();
+    float other = std::numeric_limits<float>::max();
+    int bestIdx = -1;
+    for (int i = 0; i < _prototypes.rows; i++) {
+        float d = _norms[i] - 2 * dot32f(q, _prototypes.ptr<float>(i), k);
+        if (d < best) {
+            // the previous winner becomes the runner-up if its class differs
+            if (bestIdx >= 0 && _classes[bestIdx] != _classes[i])
+                other = best;
+            best = d;
+            bestIdx = i;
+        } else if (d < other && _classes[i] != _classes[bestIdx]) {
+            other = d;
+        }
+    }
+    float qq = dot32f(q, q, k);
+    minDist = std::max(best + qq, 0.0f);
+    if (other < std::numeric_limits<float>::max())
+        otherDist = std::max(other + qq, 0.0f);
+    return _rows[bestIdx];
+}
+
+int PrototypeIndex::nearestMember(const float* q, const Mat& data, const vector<float>& norms, int classIdx,
+        float& minDist) const {
+    minDist = std::numeric_limits<float>::max();
+    int k = data.cols;
+    float best = std::numeric_limits<float>::max();
+    int bestIdx = -1;
+    for (int i = _memberOffsets[classIdx]; i < _memberOffsets[classIdx + 1]; i++) {
+        int row = _members[i];
+        float d = norms[row] - 2 * dot32f(q, data.ptr<float>(row), k);
+        if (d < best) {
+            best = d;
+            bestIdx = row;
+        }
+    }
+    if (bestIdx >= 0)
+        minDist = std::max(best + dot32f(q, q, k), 0.0f);
+    return bestIdx;
+}
@@ -0,0 +1,82 @@
+/*
+ * Face recognition based on Eigenfaces for Urbi
+ * Copyright (C) 2012  Lukasz Malek
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * File:   prototypeindex.hpp
+ */
+
+#ifndef PROTOTYPEINDEX_HPP_
+#define PROTOTYPEINDEX_HPP_
+
+#include "opencv2/opencv.hpp"
+#include <vector>
+
+using namespace std;
+using namespace cv;
+
+/*
+ * A few prototypes per class standing in for all of its rows
+ *
+ * The rows of every class with more than perClass rows are clustered with
+ * k-means. A prototype is either the cluster centre or its medoid, the
+ * member nearest to the centre. A search scans the prototypes only and also
+ * reports the distance of the best prototype of any other class, so the
+ * caller can fall back to an exact search when the decision is close.
+ */
+class PrototypeIndex {
+public:
+	enum Method {
+		KMEANS, //!< cluster centres
+		MEDOIDS //!< the rows nearest to the cluster centres
+	};
+
+private:
+	Mat _prototypes; // one prototype per row, 64 byte aligned
+	vector<float> _norms;
+	vector<int> _classes; // class of each prototype
+	vector<int> _rows; // row of the indexed data that represents each prototype
+	vector<int> _members; // rows of the indexed data grouped by class
+	vector<int> _memberOffsets; // first member of each class, plus the end
+
+public:
+	PrototypeIndex() {};
+	//! reduces the CV_32F rows of data of every class to at most perClass prototypes
+	void build(const Mat& data, const vector<int>& classes, int classCount, int perClass, Method method);
+	//! forgets the prototypes
+	void clear();
+	//! returns true if there are no prototypes
+	bool empty() const { return _prototypes.empty(); }
+	//! returns the number of prototypes
+	int size() const { return _prototypes.rows; }
+	/**
+	 * Finds the nearest prototype
+	 * Returns the row representing it, or -1 if there are no prototypes, and
+	 * its squared distance in minDist. otherDist gets the squared distance of
+	 * the nearest prototype of another class, FLT_MAX if there is none.
+	 */
+	int search(const float* q, float& minDist, float& otherDist) const;
+	/**
+	 * Finds the nearest row of a class
+	 * Cluster centres are not rows, their distances do not compare to the
+	 * distances of rows. Scans the rows of classIdx, data and norms being
+	 * the indexed data and its squared norms, returns the nearest and its
+	 * squared distance in minDist.
+	 */
+	int nearestMember(const float* q, const Mat& data, const vector<float>& norms, int classIdx,
+			float& minDist) const;
+};
+
+#endif /* PROTOTYPEINDEX_HPP_ */
@@ -0,0 +1,110 @@
+/*
+ * Face recognition based on Eigenfaces for Urbi
+ * Copyright (C) 2012  Lukasz Malek
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * File:   quantizedgallery.cpp
+ */
+
+#include "quantizedgallery.hpp"
+#include "distance.hpp"
+#include "helper.hpp"
+#include <algorithm>
+#include <cmath>
+
+void QuantizedGallery::build(const Mat& data, Type type) {
+    clear();
+    int n = data.rows;
+    int k = data.cols;
+    _type = type;
+    if (n == 0 || type == NONE)
+        return;
+    _norms.resize(n);
+    if (type == INT8) {
+        // the largest magnitude of each component maps to 127
+        _scales.assign(k, 0.0f);
+        for (int i = 0; i < n; i++) {
+            const float* p = data.ptr<float>(i);
+            for (int j = 0; j < k; j++)
+                _scales[j] = std::max(_scales[j], std::fabs(p[j]));
+        }
+        for (int j = 0; j < k; j++)
+            _scales[j] = _scales[j] > 0 ? _scales[j] / 127 : 1.0f;
+        _codes = allocAligned(n, k, CV_8S);
+        for (int i = 0; i < n; i++) {
+            const float* p = data.ptr<float>(i);
+            schar* c = _codes.ptr<schar>(i);
+            float norm = 0;
+            for (int j = 0; j < k; j++) {
+                int code = cvRound(p[j] / _scales[j]);
+                c[j] = (schar) std::max(-127, std::min(127, code));
+                float value = c[j] * _scales[j];
+                norm += value * value;
+            }
+            _norms[i] = norm;
+        }
+    } else {
+        _codes = allocAligned(n, k, CV_16U);
+        for (int i = 0; i < n; i++) {
+            const float* p = data.ptr<float>(i);
+            ushort* h = _codes.ptr<ushort>(i);
+            float norm = 0;
+            for (int j = 0; j < k; j++) {
+                h[j] = floatToHalf(p[j]);
+                float value = halfToFloat(h[j]);
+                norm += value * value;
+            }
+            _norms[i] = norm;
+        }
+    }
+}
+
+void QuantizedGallery::clear() {
+    _type = NONE;
+    _codes.release();
+    _scales.clear();
+    _norms.clear();
+}
+
+void QuantizedGallery::search(const float* q, int count, Candidates& candidates, int exclude) const {
+    candidates.clear();
+    if (empty() || count <= 0)
+        return;
+    int n = _codes.rows;
+    int k = _codes.cols;
+    // q.(scale*c) = (q*scale).c, so int8 codes are scanned with a scaled query
+    AutoBuffer<float> scaled(k);
+    if (_type == INT8) {
+        for (int j = 0; j < k; j++)
+            scaled[j] = q[j] * _scales[j];
+    }
+    // max-heap of the count best rows seen so far
+    for (int i = 0; i < n; i++) {
+        if (i == exclude)
+            continue;
+        float d = _norms[i] - 2 * (_type == INT8
+                ? dot8s32f(scaled, _codes.ptr<schar>(i), k)
+                : dot16f32f(q, _codes.ptr<ushort>(i), k));
+        if ((int) candidates.size() < count) {
+            candidates.push_back(std::make_pair(d, i));
+            std::push_heap(candidates.begin(), candidates.end());
+        } else if (d < candidates.front().first) {
+            std::pop_heap(candidates.begin(), candidates.end());
+            candidates.back() = std::make_pair(d, i);
+            std::push_heap(candidates.begin(), candidates.end());
+        }
+    }
+    std::sort_heap(candidates.begin(), candidates.end());
+}
@@ -0,0 +1,75 @@
+/*
+ * Face recognition based on Eigenfaces for Urbi
+ * Copyright (C) 2012  Lukasz Malek
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * File:   quantizedgallery.hpp
+ */
+
+#ifndef QUANTIZEDGALLERY_HPP_
+#define QUANTIZEDGALLERY_HPP_
+
+#include "opencv2/opencv.hpp"
+#include <utility>
+#include <vector>
+
+using namespace std;
+using namespace cv;
+
+/*
+ * Compressed copy of the projections for a fast first pass
+ *
+ * Every row is stored either as int8 codes with one scale per component
+ * (a quarter of the float size) or as half precision floats (half the
+ * size). A search scans the codes and returns the rows with the smallest
+ * approximate distances, which the caller re-ranks with the exact floats.
+ */
+class QuantizedGallery {
+public:
+	enum Type {
+		NONE, //!< no codes, search the floats
+		INT8, //!< per-component scaled int8
+		FP16 //!< half precision floats
+	};
+	//! (approximate squared distance without ||q||^2, row) pairs
+	typedef vector<std::pair<float, int> > Candidates;
+
+private:
+	Type _type;
+	Mat _codes; // CV_8S or CV_16U rows, 64 byte aligned
+	vector<float> _scales; // value of one int8 step per component
+	vector<float> _norms; // squared norms of the decoded rows
+
+public:
+	QuantizedGallery() : _type(NONE) {};
+	//! encodes the CV_32F rows of data
+	void build(const Mat& data, Type type);
+	//! forgets the codes
+	void clear();
+	//! returns true if nothing is encoded
+	bool empty() const { return _codes.empty(); }
+	//! returns the type of the codes
+	Type type() const { return _type; }
+	//! returns the size of the codes in bytes
+	size_t bytes() const { return _codes.empty() ? 0 : _codes.rows * _codes.cols * _codes.elemSize(); }
+	/**
+	 * Finds the count rows nearest to q by the approximate distance
+	 * The rows are returned in candidates, nearest first. Row exclude is
+	 * skipped, which allows leave-one-out tests on the encoded data.
+	 */
+	void search(const float* q, int count, Candidates& candidates, int exclude = -1) const;
+};
+
+#endif /* QUANTIZEDGALLERY_HPP_ */
@@ -0,0 +1,138 @@
+/*
+ * Face recognition based on Eigenfaces for Urbi
+ * Copyright (C) 2012  Lukasz Malek
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * File:   stats.cpp
+ */
+
+#include "stats.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <sstream>
+
+namespace {
+
+    const int STEPS_PER_OCTAVE = 4;
+
+    const char* STAGE_NAMES[RecognitionStats::STAGES] = {
+        "preprocess", "project", "search", "threshold", "total"
+    };
+
+    // bucket 0 holds everything below 1 us
+    int bucket(double seconds) {
+        double us = seconds * 1e6;
+        if (!(us >= 1))
+            return 0;
+        int b = 1 + (int) (STEPS_PER_OCTAVE * std::log(us) / std::log(2.0));
+        return b < LatencyHistogram::BUCKETS ? b : LatencyHistogram::BUCKETS - 1;
+    }
+
+    double upperBound(int b) {
+        return std::pow(2.0, (double) b / STEPS_PER_OCTAVE) * 1e-6;
+    }
+
+} // namespace
+
+LatencyHistogram::LatencyHistogram() {
+    reset();
+}
+
+void LatencyHistogram::record(double seconds) {
+    counts[bucket(seconds)].fetch_add(1, boost::memory_order_relaxed);
+    boost::uint64_t ns = seconds > 0 ? (boost::uint64_t) (seconds * 1e9) : 0;
+    total.fetch_add(ns, boost::memory_order_relaxed);
+    boost::uint64_t seen = largest.load(boost::memory_order_relaxed);
+    while (ns > seen && !largest.compare_exchange_weak(seen, ns, boost::memory_order_relaxed)) {
+    }
+}
+
+void LatencyHistogram::reset() {
+    for (int b = 0; b < BUCKETS; b++)
+        counts[b].store(0, boost::memory_order_relaxed);
+    total.store(0, boost::memory_order_relaxed);
+    largest.store(0, boost::memory_order_relaxed);
+}
+
+boost::uint64_t LatencyHistogram::count() const {
+    boost::uint64_t n = 0;
+    for (int b = 0; b < BUCKETS; b++)
+        n += counts[b].load(boost::memory_order_relaxed);
+    return n;
+}
+
+double LatencyHistogram::mean() const {
+    boost::uint64_t n = count();
+    return n ? total.load(boost::memory_order_relaxed) * 1e-9 / n : 0;
+}
+
+double LatencyHistogram::percentile(double p) const {
+    boost::uint64_t snapshot[BUCKETS];
+    boost::uint64_t n = 0;
+    for (int b = 0; b < BUCKETS; b++) {
+        snapshot[b] = counts[b].load(boost::memory_order_relaxed);
+        n += snapshot[b];
+    }
+    if (n == 0)
+        return 0;
+    boost::uint64_t rank = (boost::uint64_t) std::ceil(p * n);
+    boost::uint64_t seen = 0;
+    for (int b = 0; b < BUCKETS; b++) {
+        seen += snapshot[b];
+        // the bucket bound may exceed any latency actually seen
+        if (seen >= rank && snapshot[b])
+            return std::min(upperBound(b), max());
+    }
+    return max();
+}
+
+double LatencyHistogram::max() const {
+    return largest.load(boost::memory_order_relaxed) * 1e-9;
+}
+
+RecognitionStats::RecognitionStats() : calls(0), rejections(0), nonFaces(0), cacheHits(0), drops(0), modelVersion(0) {
+}
+
+void RecognitionStats::reset() {
+    for (int stage = 0; stage < STAGES; stage++)
+        stages[stage].reset();
+    calls.store(0, boost::memory_order_relaxed);
+    rejections.store(0, boost::memory_order_relaxed);
+    nonFaces.store(0, boost::memory_order_relaxed);
+    cacheHits.store(0, boost::memory_order_relaxed);
+    drops.store(0, boost::memory_order_relaxed);
+}
+
+std::string RecognitionStats::report() const {
+    std::ostringstream os;
+    os << "model " << modelVersion.load(boost::memory_order_relaxed)
+            << " calls " << calls.load(boost::memory_order_relaxed)
+            << " rejections " << rejections.load(boost::memory_order_relaxed)
+            << " non faces " << nonFaces.load(boost::memory_order_relaxed)
+            << " cache hits " << cacheHits.load(boost::memory_order_relaxed)
+            << " dropped " << drops.load(boost::memory_order_relaxed) << "\n";
+    os << "stage           count    mean_us     p50_us     p90_us     p99_us     max_us\n";
+    for (int stage = 0; stage < STAGES; stage++) {
+        const LatencyHistogram& h = stages[stage];
+        char line[160];
+        snprintf(line, sizeof (line), "%-10s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                STAGE_NAMES[stage], (unsigned long long) h.count(), h.mean() * 1e6,
+                h.percentile(0.5) * 1e6, h.percentile(0.9) * 1e6,
+                h.percentile(0.99) * 1e6, h.max() * 1e6);
+        os << line;
+    }
+    return os.str();
+}
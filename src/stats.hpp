@@ -0,0 +1,118 @@
+/*
+ * Face recognition based on Eigenfaces for Urbi
+ * Copyright (C) 2012  Lukasz Malek
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * File:   stats.hpp
+ */
+
+#ifndef STATS_HPP
+#define	STATS_HPP
+
+#include <string>
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+
+/**
+ * Latency histogram that can be recorded into from any thread
+ *
+ * Buckets are a quarter of an octave wide, from 1 us to about 16 s, so a
+ * percentile is accurate to 19%. Recording is a few relaxed atomic
+ * increments and never blocks.
+ */
+class LatencyHistogram {
+public:
+    static const int BUCKETS = 98;
+
+    LatencyHistogram();
+    void record(double seconds);
+    void reset();
+
+    boost::uint64_t count() const;
+    //! mean latency in seconds
+    double mean() const;
+    //! upper bound of the bucket holding the p-th fraction of the samples, in seconds
+    double percentile(double p) const;
+    //! largest latency recorded, in seconds
+    double max() const;
+
+private:
+    boost::atomic<boost::uint64_t> counts[BUCKETS];
+    boost::atomic<boost::uint64_t> total; // nanoseconds
+    boost::atomic<boost::uint64_t> largest; // nanoseconds
+};
+
+/**
+ * Statistics of the recognition path
+ * One histogram per stage of find() plus counters. Readers get a
+ * consistent enough snapshot for monitoring, not an atomic one.
+ */
+class RecognitionStats {
+public:
+    enum Stage {
+        PREPROCESS, //!< grey, resize, convert and subtract the mean
+        PROJECT, //!< project onto the eigenvectors
+        SEARCH, //!< nearest neighbour search
+        THRESHOLD, //!< threshold test and result
+        TOTAL, //!< whole call, including waiting for a slot
+        STAGES
+    };
+
+    RecognitionStats();
+
+    void record(Stage stage, double seconds) {
+        stages[stage].record(seconds);
+    }
+
+    void call() {
+        calls.fetch_add(1, boost::memory_order_relaxed);
+    }
+
+    void rejection() {
+        rejections.fetch_add(1, boost::memory_order_relaxed);
+    }
+
+    void nonFace() {
+        nonFaces.fetch_add(1, boost::memory_order_relaxed);
+    }
+
+    void drop() {
+        drops.fetch_add(1, boost::memory_order_relaxed);
+    }
+
+    void cacheHit() {
+        cacheHits.fetch_add(1, boost::memory_order_relaxed);
+    }
+
+    void modelPublished() {
+        modelVersion.fetch_add(1, boost::memory_order_relaxed);
+    }
+
+    //! resets the histograms and the call counters, not the model version
+    void reset();
+    //! returns a table of the counters and the latency percentiles
+    std::string report() const;
+
+private:
+    LatencyHistogram stages[STAGES];
+    boost::atomic<boost::uint64_t> calls;
+    boost::atomic<boost::uint64_t> rejections;
+    boost::atomic<boost::uint64_t> nonFaces;
+    boost::atomic<boost::uint64_t> cacheHits;
+    boost::atomic<boost::uint64_t> drops;
+    boost::atomic<unsigned> modelVersion;
+};
+
+#endif	/* STATS_HPP */